@@ -1,16 +1,19 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include "analysis.h"
+#include "lexer.h"
 #include "modtable.h"
 #include "util.h"
 #include "log.h"
 
+#include "xxhash/xxhash.h"
+
+#include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 #if MII_ENABLE_LUA
-#include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 
@@ -30,57 +33,153 @@
 
 #include <dirent.h>
 #include <errno.h>
-#include <regex.h>
 #include <unistd.h>
 #include <sys/stat.h>
-#include <wordexp.h>
 
-#if !MII_ENABLE_LUA
-static const char* _mii_analysis_lmod_regex_src =
-    "\\s*(prepend_path|append_path)\\s*\\(\\s*"
-    "\"PATH\"\\s*,\\s*\"([^\"]+)\"";
+#if MII_ENABLE_LUA
+/* run lua module code in a sandbox, the interpreter is started for the first module which needs it */
+int _mii_analysis_lua_init(mii_analysis_state* s);
+int _mii_analysis_lmod_sandbox(mii_analysis_state* s, mii_modtable_entry* mod);
+int _mii_analysis_lua_run(mii_analysis_state* s, const char* code, char*** paths_out, int* num_paths_out);
 
-static regex_t _mii_analysis_lmod_regex;
-#else
-/* Lua interpreter state */
-static lua_State *lua_state;
+/* the budget is enforced by the allocator and an instruction count hook */
+void* _mii_analysis_lua_alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+void _mii_analysis_lua_hook(lua_State* lua_state, lua_Debug* ar);
 
-/* run lua module code in a sandbox */
-int _mii_analysis_lua_run(lua_State* lua_state, const char* code, char*** paths_out, int* num_paths_out);
 #endif
 
-/* word expansion functions */
-char* _mii_analysis_expand(const char* expr);
+/* variables set by a tcl module, they only apply to the rest of that module */
+typedef struct _mii_analysis_vars {
+    char** keys, **values;
+    int count;
+} mii_analysis_vars;
+
+void _mii_analysis_vars_set(mii_analysis_vars* vars, const char* key, char* value);
+const char* _mii_analysis_vars_get(const mii_analysis_vars* vars, const char* key, size_t key_len);
+void _mii_analysis_vars_free(mii_analysis_vars* vars);
+
+/*
+ * what a tcl module has defined so far, the module's setenv calls shadow
+ * the process environment without changing it
+ */
+typedef struct _mii_analysis_tcl_scope {
+    mii_analysis_vars vars, env;
+} mii_analysis_tcl_scope;
+
+/* growable string */
+typedef struct _mii_analysis_buf {
+    char* data;
+    size_t len, capacity;
+} mii_analysis_buf;
 
-/* module type analysis functions */
-int _mii_analysis_lmod(const char* path, char*** bins_out, int* num_bins_out);
-int _mii_analysis_tcl(const char* path, char*** bins_out, int* num_bins_out);
+void _mii_analysis_append(mii_analysis_buf* buf, const char* str, size_t n);
+
+/*
+ * what an lmod module has defined so far, setenv calls are seen by os.getenv
+ * like they are when Lmod loads the module
+ */
+typedef struct _mii_analysis_lua_scope {
+    mii_analysis_vars vars, env;
+    const mii_modtable_entry* mod;
+} mii_analysis_lua_scope;
+
+/* lua subset evaluator, string expressions are evaluated without running an interpreter */
+int _mii_analysis_lua_statement(mii_analysis_state* s, mii_modtable_entry* mod, mii_analysis_lua_scope* scope, const char* c);
+int _mii_analysis_lua_call(mii_analysis_state* s, mii_modtable_entry* mod, mii_analysis_lua_scope* scope, const char* name, size_t name_len, const char** cur);
+int _mii_analysis_lua_args(const char** cur, const mii_analysis_lua_scope* scope, char*** args_out, int* num_args_out);
+int _mii_analysis_lua_expr(const char** cur, const mii_analysis_lua_scope* scope, mii_analysis_buf* out);
+int _mii_analysis_lua_term(const char** cur, const mii_analysis_lua_scope* scope, mii_analysis_buf* out);
+int _mii_analysis_lua_function(const char* name, size_t name_len, char** args, int num_args, const mii_analysis_lua_scope* scope, mii_analysis_buf* out);
+int _mii_analysis_lua_string(const char** cur, mii_analysis_buf* out);
+void _mii_analysis_lua_path_join(char** args, int num_args, mii_analysis_buf* out);
+void _mii_analysis_lua_skip(const char** cur);
+void _mii_analysis_lua_free_args(char** args, int num_args);
+size_t _mii_analysis_lua_name(const char* c);
+
+/* tcl subset expander, words are substituted as tcl would without running an interpreter */
+int _mii_analysis_tcl_command(mii_analysis_state* s, mii_modtable_entry* mod, mii_analysis_tcl_scope* scope, const char** cur);
+int _mii_analysis_tcl_path_var(char** words, int num_words);
+int _mii_analysis_tcl_word(const char** cur, const mii_analysis_tcl_scope* scope, int nested, char** word_out);
+int _mii_analysis_tcl_dollar(const char** cur, const mii_analysis_tcl_scope* scope, mii_analysis_buf* out);
+int _mii_analysis_tcl_bracket(const char** cur, const mii_analysis_tcl_scope* scope, mii_analysis_buf* out);
+int _mii_analysis_tcl_eval(char** words, int num_words, mii_analysis_buf* out);
+void _mii_analysis_tcl_backslash(const char** cur, mii_analysis_buf* out);
+const char* _mii_analysis_tcl_getenv(const mii_analysis_tcl_scope* scope, const char* name, size_t name_len);
+
+/* module type analysis functions, return the tier which analyzed the module */
+int _mii_analysis_lmod(mii_analysis_state* s, mii_modtable_entry* mod);
+int _mii_analysis_lmod_static(mii_analysis_state* s, mii_modtable_entry* mod);
+int _mii_analysis_tcl(mii_analysis_state* s, mii_modtable_entry* mod);
+void _mii_analysis_reset(mii_modtable_entry* mod);
 
 /* path scanning functions */
-int _mii_analysis_scan_path(char* path, char*** bins_out, int* num_bins_out);
+int _mii_analysis_scan_path(mii_analysis_cache* cache, char* path, mii_modtable_entry* mod);
+void _mii_analysis_add_use(mii_modtable_entry* mod, char* path);
+void _mii_analysis_scan_dir(const char* path, char*** bins_out, int* num_bins_out);
+void _mii_analysis_copy_bins(const mii_analysis_scan* scan, char*** bins_out, int* num_bins_out);
+const mii_analysis_path* _mii_analysis_cache_stat(mii_analysis_cache* c, const char* path);
+int _mii_analysis_path_current(const mii_analysis_path* path, const struct timespec* mtime);
+const mii_analysis_scan* _mii_analysis_cache_scan(mii_analysis_cache* c, const mii_analysis_path* path);
 
 #if MII_ENABLE_SPIDER
 int _mii_analysis_parents_from_json(const cJSON* json, char*** parents_out, int* num_parents_out);
 #endif
 
-#if !MII_ENABLE_LUA
-/*
- * compile regexes
- */
-int mii_analysis_init() {
-    if (regcomp(&_mii_analysis_lmod_regex, _mii_analysis_lmod_regex_src, REG_EXTENDED | REG_NEWLINE)) {
-        mii_error("failed to compile Lmod analysis regex");
-        return -1;
+/* sandbox budget for each module, only read once analysis started */
+static int _mii_analysis_lua_instructions = MII_ANALYSIS_LUA_INSTRUCTIONS;
+static size_t _mii_analysis_lua_memory = (size_t) MII_ANALYSIS_LUA_MEMORY << 20;
+
+void mii_analysis_lua_budget(int instructions, int memory) {
+    _mii_analysis_lua_instructions = (instructions > 0) ? instructions : 0;
+    _mii_analysis_lua_memory = (memory > 0) ? (size_t) memory << 20 : 0;
+}
+
+void mii_analysis_cache_init(mii_analysis_cache* c) {
+    memset(c, 0, sizeof *c);
+    pthread_mutex_init(&c->lock, NULL);
+}
+
+void mii_analysis_cache_free(mii_analysis_cache* c) {
+    mii_debug("Scanned %d PATH directories, reused %d scans", c->misses, c->hits);
+
+    for (int i = 0; i < MII_ANALYSIS_CACHE_WIDTH; ++i) {
+        mii_analysis_scan* cur = c->buf[i], *tmp;
+
+        while (cur) {
+            for (int j = 0; j < cur->num_bins; ++j) free(cur->bins[j]);
+            free(cur->bins);
+
+            tmp = cur->next;
+            free(cur);
+            cur = tmp;
+        }
+
+        mii_analysis_path* cur_path = c->paths[i], *tmp_path;
+
+        while (cur_path) {
+            free(cur_path->path);
+
+            tmp_path = cur_path->next;
+            free(cur_path);
+            cur_path = tmp_path;
+        }
     }
 
+    pthread_mutex_destroy(&c->lock);
+}
+
+int mii_analysis_init(mii_analysis_state* s, mii_analysis_cache* cache) {
+    memset(s, 0, sizeof *s);
+    s->cache = cache;
     return 0;
 }
-#else
+
+#if MII_ENABLE_LUA
 /*
- * initialize Lua interpreter
+ * initialize a Lua interpreter
  */
-int mii_analysis_init() {
-    lua_state = luaL_newstate();
+int _mii_analysis_lua_init(mii_analysis_state* s) {
+    lua_State* lua_state = s->lua_state = lua_newstate(_mii_analysis_lua_alloc, &s->lua_heap);
     luaL_openlibs(lua_state);
 
     /* sandbox path when mii is installed */
@@ -102,51 +201,152 @@ int mii_analysis_init() {
             return 0;
     }
 
-    mii_error("failed to load Lua file");
+    mii_error("failed to load Lua file, unresolved modules won't be run in the sandbox");
     lua_close(lua_state);
 
+    s->lua_state = NULL;
+    s->lua_failed = 1;
+
     return -1;
 }
 #endif
 
 /*
- * cleanup regexes or Lua interpreter
+ * cleanup the Lua interpreter
  */
-void mii_analysis_free() {
-#if !MII_ENABLE_LUA
-    regfree(&_mii_analysis_lmod_regex);
+void mii_analysis_free(mii_analysis_state* s) {
+#if MII_ENABLE_LUA
+    if (s->lua_state) lua_close(s->lua_state);
 #else
-    lua_close(lua_state);
+    (void) s;
 #endif
 }
 
 /*
  * run analysis for an arbitrary module
  */
-int mii_analysis_run(const char* modfile, int modtype, char*** bins_out, int* num_bins_out) {
-    switch (modtype) {
+int mii_analysis_run(mii_analysis_state* s, mii_modtable_entry* mod) {
+    int tier;
+
+    switch (mod->type) {
     case MII_MODTABLE_MODTYPE_LMOD:
-        return _mii_analysis_lmod(modfile, bins_out, num_bins_out);
+        tier = _mii_analysis_lmod(s, mod);
+        break;
     case MII_MODTABLE_MODTYPE_TCL:
-        return _mii_analysis_tcl(modfile, bins_out, num_bins_out);
+        tier = _mii_analysis_tcl(s, mod);
+        break;
+    default:
+        return 0;
     }
 
+    if (tier < 0) return -1;
+
+    ++s->tiers[tier];
     return 0;
 }
 
+/*
+ * rebuild the bins of an analyzed module, keeping the runs of PATH directories whose mtime didn't move
+ * returns 0 if nothing changed or the bins can't be matched to their directories
+ */
+int mii_analysis_refresh(mii_analysis_state* s, mii_modtable_entry* mod) {
+    int total = 0, changed = 0;
+
+    for (int i = 0; i < mod->num_dirs; ++i) total += mod->dirs[i].num_bins;
+    if (total != mod->num_bins) return 0;
+
+    /* directories are stat()ed once per cache, so checking every module is cheap */
+    const mii_analysis_path** paths = malloc(mod->num_dirs * sizeof *paths);
+
+    for (int i = 0; i < mod->num_dirs; ++i) {
+        paths[i] = _mii_analysis_cache_stat(s->cache, mod->dirs[i].path);
+        if (!_mii_analysis_path_current(paths[i], &mod->dirs[i].mtime)) changed = 1;
+    }
+
+    if (!changed) {
+        free(paths);
+        return 0;
+    }
+
+    char** bins = NULL;
+    int num_bins = 0, old = 0;
+
+    for (int i = 0; i < mod->num_dirs; ++i) {
+        mii_modtable_bin_dir* dir = mod->dirs + i;
+
+        if (_mii_analysis_path_current(paths[i], &dir->mtime)) {
+            /* unchanged, the run moves over as it is */
+            if (dir->num_bins) {
+                bins = realloc(bins, (num_bins + dir->num_bins) * sizeof *bins);
+                memcpy(bins + num_bins, mod->bins + old, dir->num_bins * sizeof *bins);
+            }
+
+            num_bins += dir->num_bins;
+            old += dir->num_bins;
+            continue;
+        }
+
+        mii_debug("PATH directory %s of %s changed, scanning again", dir->path, mod->path);
+
+        for (int j = 0; j < dir->num_bins; ++j) free(mod->bins[old + j]);
+        old += dir->num_bins;
+
+        const mii_analysis_scan* scan = paths[i]->found ? _mii_analysis_cache_scan(s->cache, paths[i]) : NULL;
+
+        dir->mtime.tv_sec = -1;
+        dir->mtime.tv_nsec = 0;
+        dir->num_bins = 0;
+
+        if (!scan) continue;
+
+        dir->mtime = paths[i]->mtime;
+        dir->num_bins = scan->num_bins;
+
+        _mii_analysis_copy_bins(scan, &bins, &num_bins);
+    }
+
+    free(paths);
+    free(mod->bins);
+    mod->bins = bins;
+    mod->num_bins = num_bins;
+
+    return 1;
+}
+
+/*
+ * check if a PATH entry still has the mtime it was recorded with
+ */
+int _mii_analysis_path_current(const mii_analysis_path* path, const struct timespec* mtime) {
+    if (!path->found) return mtime->tv_sec == -1;
+
+    return path->mtime.tv_sec == mtime->tv_sec && path->mtime.tv_nsec == mtime->tv_nsec;
+}
+
 #if MII_ENABLE_LUA
 /*
  * run a modulefile's code in a Lua sandbox
  */
-int _mii_analysis_lua_run(lua_State* lua_state, const char* code, char*** paths_out, int* num_paths_out) {
+int _mii_analysis_lua_run(mii_analysis_state* s, const char* code, char*** paths_out, int* num_paths_out) {
+    lua_State* lua_state = s->lua_state;
+
+    /* the budget starts over for every module */
+    s->lua_heap.exceeded = 0;
+    s->lua_heap.limit = _mii_analysis_lua_memory ? s->lua_heap.used + _mii_analysis_lua_memory : 0;
+
+    if (_mii_analysis_lua_instructions) lua_sethook(lua_state, _mii_analysis_lua_hook, LUA_MASKCOUNT, _mii_analysis_lua_instructions);
+
     /* execute modulefile */
     int res;
     lua_getglobal(lua_state, "sandbox_run");
     lua_pushstring(lua_state, code);
     res = lua_pcall(lua_state, 1, 1, 0);
 
+    lua_sethook(lua_state, NULL, 0, 0);
+    s->lua_heap.limit = 0;
+
     if(res != LUA_OK) {
-        mii_error("Error occurred in Lua sandbox : %s", lua_tostring(lua_state, -1));
+        /* going over the budget isn't an error in the sandbox, the caller reports it */
+        if (!s->lua_heap.exceeded) mii_error("Error occurred in Lua sandbox : %s", lua_tostring(lua_state, -1));
         lua_pop(lua_state, 1);
         return -1;
     }
@@ -171,190 +371,1188 @@ int _mii_analysis_lua_run(lua_State* lua_state, const char* code, char*** paths_
 #endif
 
 /*
- * extract paths from an lmod file
+ * extract paths from an lmod file, modules the static pass can't resolve are run in the Lua sandbox
+ */
+int _mii_analysis_lmod(mii_analysis_state* s, mii_modtable_entry* mod) {
+    int unresolved = _mii_analysis_lmod_static(s, mod);
+
+    if (unresolved < 0) return -1;
+    if (!unresolved) return MII_ANALYSIS_TIER_STATIC;
+
+#if MII_ENABLE_LUA
+    int tier = _mii_analysis_lmod_sandbox(s, mod);
+    if (tier >= 0) return tier;
+#endif
+
+    mii_debug("%d PATH changes in %s couldn't be evaluated", unresolved, mod->path);
+    return MII_ANALYSIS_TIER_UNRESOLVED;
+}
+
+/*
+ * evaluate the PATH changes of an lmod file without running it
+ * returns the number of changes which couldn't be evaluated
+ */
+int _mii_analysis_lmod_static(mii_analysis_state* s, mii_modtable_entry* mod) {
+    mii_analysis_lua_scope scope;
+    mii_lexer lex;
+    int unresolved = 0;
+
+    if (mii_lexer_open(&lex, mod->path, MII_LEXER_LUA)) return -1;
+
+    memset(&scope, 0, sizeof scope);
+    scope.mod = mod;
+
+    for (char* stmt; (stmt = mii_lexer_next(&lex));) {
+        /* only assignments and calls changing PATH or the environment are interpreted */
+        if (!strstr(stmt, "_path") && !strchr(stmt, '=') && !strstr(stmt, "env")) continue;
+
+        unresolved += _mii_analysis_lua_statement(s, mod, &scope, stmt);
+    }
+
+    _mii_analysis_vars_free(&scope.vars);
+    _mii_analysis_vars_free(&scope.env);
+    mii_lexer_close(&lex);
+
+    return unresolved;
+}
+
+#if MII_ENABLE_LUA
+/*
+ * run an lmod file in the sandbox, its paths replace the ones found statically
+ * returns the tier which analyzed the module, the static paths are kept if the run fails or goes over budget
  */
-int _mii_analysis_lmod(const char* path, char*** bins_out, int* num_bins_out) {
-    FILE* f = fopen(path, "r");
+int _mii_analysis_lmod_sandbox(mii_analysis_state* s, mii_modtable_entry* mod) {
+    mii_lexer lex;
+
+    if (s->lua_failed || (!s->lua_state && _mii_analysis_lua_init(s))) return -1;
+
+    /* the static pass terminated statements in the buffer, the sandbox needs the file as written */
+    if (mii_lexer_open(&lex, mod->path, MII_LEXER_LUA)) return -1;
+
+    /* get binaries paths */
+    char** bin_paths;
+    int num_paths;
+
+    int res = _mii_analysis_lua_run(s, lex.buf, &bin_paths, &num_paths);
+
+    /* every module runs in a fresh environment, collect the last one before it can pile up */
+    lua_gc(s->lua_state, LUA_GCCOLLECT, 0);
+    mii_lexer_close(&lex);
+
+    if (res && s->lua_heap.exceeded) {
+        mii_warn("%s went over the Lua sandbox budget, keeping the paths found without it", mod->path);
+        return MII_ANALYSIS_TIER_TIMEOUT;
+    }
 
-    if (!f) {
-        mii_error("Couldn't open %s for reading : %s", path, strerror(errno));
+    if (res) {
+        mii_warn("Error occurred when executing %s, keeping the paths found without it", mod->path);
         return -1;
     }
 
-#if !MII_ENABLE_LUA
-    char linebuf[MII_ANALYSIS_LINEBUF_SIZE];
-    regmatch_t matches[3];
+    _mii_analysis_reset(mod);
+
+    /* scan every path returned */
+    for (int i = 0; i < num_paths; ++i) {
+        _mii_analysis_scan_path(s->cache, bin_paths[i], mod);
+        free(bin_paths[i]);
+    }
+
+    free(bin_paths);
+
+    return MII_ANALYSIS_TIER_SANDBOX;
+}
+
+/*
+ * allocate for a sandbox, failing once the running module's memory budget is spent
+ */
+void* _mii_analysis_lua_alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+    mii_analysis_lua_heap* heap = ud;
+
+    /* osize is only the block's size when there is a block */
+    if (!ptr) osize = 0;
+
+    if (!nsize) {
+        free(ptr);
+        heap->used -= osize;
+        return NULL;
+    }
+
+    if (heap->limit && nsize > osize && heap->used - osize + nsize > heap->limit) {
+        heap->exceeded = 1;
+        return NULL;
+    }
+
+    void* res = realloc(ptr, nsize);
+    if (res) heap->used = heap->used - osize + nsize;
+
+    return res;
+}
+
+/*
+ * called once the running module used up its instructions
+ */
+void _mii_analysis_lua_hook(lua_State* lua_state, lua_Debug* ar) {
+    void* ud;
+    (void) ar;
+
+    lua_getallocf(lua_state, &ud);
+    ((mii_analysis_lua_heap*) ud)->exceeded = 1;
+
+    luaL_error(lua_state, "instruction budget exceeded");
+}
+#endif
+
+/*
+ * forget the bins and PATH directories found for a module
+ */
+void _mii_analysis_reset(mii_modtable_entry* mod) {
+    for (int i = 0; i < mod->num_bins; ++i) free(mod->bins[i]);
+    for (int i = 0; i < mod->num_dirs; ++i) free(mod->dirs[i].path);
+
+    free(mod->bins);
+    free(mod->dirs);
+
+    mod->bins = NULL;
+    mod->dirs = NULL;
+    mod->num_bins = mod->num_dirs = 0;
+}
+
+/*
+ * extract paths from a tcl file
+ */
+int _mii_analysis_tcl(mii_analysis_state* s, mii_modtable_entry* mod) {
+    mii_lexer lex;
+
+    if (mii_lexer_open(&lex, mod->path, MII_LEXER_TCL)) return -1;
+
+    mii_analysis_tcl_scope scope;
+    int unresolved = 0;
+
+    memset(&scope, 0, sizeof scope);
+
+    for (char* stmt; (stmt = mii_lexer_next(&lex));) {
+        /* quoted words and brackets can still hold newlines */
+        for (const char* cur = stmt; *cur;) {
+            unresolved += _mii_analysis_tcl_command(s, mod, &scope, &cur);
+        }
+    }
+
+    _mii_analysis_vars_free(&scope.vars);
+    _mii_analysis_vars_free(&scope.env);
+    mii_lexer_close(&lex);
+
+    if (!unresolved) return MII_ANALYSIS_TIER_STATIC;
+
+    mii_debug("%d PATH changes in %s couldn't be expanded", unresolved, mod->path);
+    return MII_ANALYSIS_TIER_UNRESOLVED;
+}
+
+/*
+ * run one tcl command, only commands which can change PATH are interpreted
+ * <cur> is left after the command's separator, returns 1 if a PATH change couldn't be expanded
+ */
+int _mii_analysis_tcl_command(mii_analysis_state* s, mii_modtable_entry* mod, mii_analysis_tcl_scope* scope, const char** cur) {
+    char** words = NULL, *word;
+    int num_words = 0, res, arg, unresolved = 0;
+
+    while (**cur == ' ' || **cur == '\t') ++*cur;
 
-    while (fgets(linebuf, sizeof linebuf, f)) {
-        /* strip off newline */
-        int len = strlen(linebuf);
-        if (linebuf[len - 1] == '\n') linebuf[len - 1] = 0;
+    /* comments run to the end of the line */
+    if (**cur == '#') {
+        while (**cur && **cur != '\n') ++*cur;
+    }
 
-        /* execute regex */
-        if (!regexec(&_mii_analysis_lmod_regex, linebuf, 3, matches, 0)) {
-            if (matches[2].rm_so < 0) continue;
-            linebuf[matches[2].rm_eo] = 0;
+    while ((res = _mii_analysis_tcl_word(cur, scope, 0, &word)) > 0) {
+        words = realloc(words, (num_words + 1) * sizeof *words);
+        words[num_words++] = word;
+    }
 
-            _mii_analysis_scan_path(linebuf + matches[2].rm_so, bins_out, num_bins_out);
+    if (res < 0) {
+        /* a word which couldn't be expanded spoils the whole command */
+        mii_debug("Skipping tcl command in %s, couldn't expand a word", mod->path);
+        while (**cur && **cur != '\n' && **cur != ';') ++*cur;
+
+        /* the module is unresolved if the command could have changed PATH */
+        arg = _mii_analysis_tcl_path_var(words, num_words);
+        unresolved = arg && (arg >= num_words || !strcmp(words[arg], "PATH"));
+    } else if (num_words == 3 && !strcmp(words[0], "set")) {
+        _mii_analysis_vars_set(&scope->vars, words[1], mii_strdup(words[2]));
+    } else if (num_words == 3 && !strcmp(words[0], "setenv")) {
+        _mii_analysis_vars_set(&scope->env, words[1], mii_strdup(words[2]));
+    } else if ((arg = _mii_analysis_tcl_path_var(words, num_words)) && arg < num_words && !strcmp(words[arg], "PATH")) {
+        for (++arg; arg < num_words; ++arg) _mii_analysis_scan_path(s->cache, words[arg], mod);
+    } else if (arg && arg < num_words && !strcmp(words[arg], "MODULEPATH")) {
+        for (++arg; arg < num_words; ++arg) _mii_analysis_add_use(mod, words[arg]);
+    } else if (num_words >= 3 && !strcmp(words[0], "module") && !strcmp(words[1], "use")) {
+        /* module use [-a|--append] dir ... */
+        for (arg = 2; arg < num_words; ++arg) {
+            if (words[arg][0] != '-') _mii_analysis_add_use(mod, words[arg]);
         }
     }
 
-    fclose(f);
-#else
-    char* buffer;
-    fseek(f, 0L, SEEK_END);
-    long s = ftell(f);
-    rewind(f);
-    buffer = malloc(s + 1);
-    if ( buffer != NULL ) {
-        fread(buffer, s, 1, f);
-        fclose(f); f = NULL;
-        buffer[s] = '\0';
-
-        /* get binaries paths */
-        char** bin_paths;
-        int num_paths;
-        if(_mii_analysis_lua_run(lua_state, buffer, &bin_paths, &num_paths)) {
-            mii_error("Error occurred when executing %s, skipping", path);
-            free(buffer);
+    if (**cur) ++*cur;
+
+    for (int i = 0; i < num_words; ++i) free(words[i]);
+    free(words);
+
+    return unresolved;
+}
+
+/*
+ * index of the variable a prepend-path or append-path command changes, 0 for other commands
+ * options come before the variable, the delimiter option takes a value
+ */
+int _mii_analysis_tcl_path_var(char** words, int num_words) {
+    int arg = 1;
+
+    if (!num_words || (strcmp(words[0], "prepend-path") && strcmp(words[0], "append-path"))) return 0;
+
+    for (; arg < num_words && words[arg][0] == '-'; ++arg) {
+        if (!strcmp(words[arg], "-d") || !strcmp(words[arg], "--delim") || !strcmp(words[arg], "--delimiter")) ++arg;
+    }
+
+    return arg;
+}
+
+/*
+ * read and substitute the next word of a command
+ * returns 1 if a word was stored in *word_out, 0 at the end of the command, -1 if it can't be expanded
+ */
+int _mii_analysis_tcl_word(const char** cur, const mii_analysis_tcl_scope* scope, int nested, char** word_out) {
+    const char* c = *cur;
+    mii_analysis_buf out = {0};
+    int res = 0;
+
+    *word_out = NULL;
+
+    /* words are separated by blanks, an escaped newline is a blank too */
+    while (*c == ' ' || *c == '\t' || (*c == '\\' && c[1] == '\n')) c += (*c == '\\') ? 2 : 1;
+
+    *cur = c;
+
+    if (!*c || *c == '\n' || *c == ';' || (nested && *c == ']')) return 0;
+
+    if (*c == '{') {
+        /* braces quote everything up to the matching brace */
+        const char* start = ++c;
+        int depth = 1;
+
+        for (; *c; ++c) {
+            if (*c == '\\' && c[1]) {
+                ++c;
+            } else if (*c == '{') {
+                ++depth;
+            } else if (*c == '}' && !--depth) {
+                break;
+            }
+        }
+
+        if (!*c) res = -1;
+        else _mii_analysis_append(&out, start, c++ - start);
+    } else {
+        int quoted = *c == '"';
+        if (quoted) ++c;
+
+        while (*c && !res) {
+            if (quoted ? *c == '"' : (*c == ' ' || *c == '\t' || *c == '\n' || *c == ';' || (nested && *c == ']'))) break;
+
+            if (*c == '\\') {
+                _mii_analysis_tcl_backslash(&c, &out);
+            } else if (*c == '$') {
+                res = _mii_analysis_tcl_dollar(&c, scope, &out);
+            } else if (*c == '[') {
+                res = _mii_analysis_tcl_bracket(&c, scope, &out);
+            } else {
+                _mii_analysis_append(&out, c++, 1);
+            }
+        }
+
+        if (quoted && !res) {
+            if (*c == '"') ++c;
+            else res = -1;
+        }
+    }
+
+    *cur = c;
+
+    if (res) {
+        free(out.data);
+        return -1;
+    }
+
+    _mii_analysis_append(&out, "", 1);
+    *word_out = out.data;
+    return 1;
+}
+
+/*
+ * substitute $name, ${name}, $env(NAME) or $::env(NAME)
+ * module variables come first, unknown names are looked up in the environment like before
+ */
+int _mii_analysis_tcl_dollar(const char** cur, const mii_analysis_tcl_scope* scope, mii_analysis_buf* out) {
+    const char* c = *cur + 1, *name = c, *value = NULL;
+    size_t name_len;
+    int braced = *c == '{';
+
+    if (braced) {
+        name = ++c;
+        while (*c && *c != '}') ++c;
+
+        if (!*c) return -1;
+        name_len = c++ - name;
+    } else {
+        while (isalnum((unsigned char) *c) || *c == '_' || (*c == ':' && c[1] == ':')) c += (*c == ':') ? 2 : 1;
+        name_len = c - name;
+    }
+
+    /* a dollar which doesn't start a name stays as it is */
+    if (!name_len) {
+        _mii_analysis_append(out, "$", 1);
+        *cur = c;
+        return 0;
+    }
+
+    /* variables in the global namespace are the module's variables */
+    if (name_len > 2 && !strncmp(name, "::", 2)) {
+        name += 2;
+        name_len -= 2;
+    }
+
+    if (*c == '(' && !braced) {
+        /* array elements, the environment is the only array modules read */
+        mii_analysis_buf key = {0};
+        int res = 0;
+
+        for (++c; *c && *c != ')' && !res;) {
+            if (*c == '$') {
+                res = _mii_analysis_tcl_dollar(&c, scope, &key);
+            } else if (*c == '\\') {
+                _mii_analysis_tcl_backslash(&c, &key);
+            } else {
+                _mii_analysis_append(&key, c++, 1);
+            }
+        }
+
+        if (res || *c != ')' || name_len != 3 || strncmp(name, "env", 3)) {
+            free(key.data);
+            *cur = c;
             return -1;
         }
 
-        /* scan every path returned */
-        for(int i = 0; i < num_paths; ++i) {
-            _mii_analysis_scan_path(bin_paths[i], bins_out, num_bins_out);
-            free(bin_paths[i]);
+        ++c;
+        value = _mii_analysis_tcl_getenv(scope, key.data ? key.data : "", key.len);
+        free(key.data);
+    } else {
+        value = _mii_analysis_vars_get(&scope->vars, name, name_len);
+        if (!value) value = _mii_analysis_tcl_getenv(scope, name, name_len);
+    }
+
+    if (value) _mii_analysis_append(out, value, strlen(value));
+
+    *cur = c;
+    return 0;
+}
+
+/*
+ * substitute the result of a bracketed command
+ */
+int _mii_analysis_tcl_bracket(const char** cur, const mii_analysis_tcl_scope* scope, mii_analysis_buf* out) {
+    const char* c = *cur + 1;
+    char** words = NULL, *word;
+    int num_words = 0, res;
+
+    while ((res = _mii_analysis_tcl_word(&c, scope, 1, &word)) > 0) {
+        words = realloc(words, (num_words + 1) * sizeof *words);
+        words[num_words++] = word;
+    }
+
+    if (!res && *c != ']') res = -1;
+
+    if (!res) {
+        ++c;
+        res = _mii_analysis_tcl_eval(words, num_words, out);
+    }
+
+    for (int i = 0; i < num_words; ++i) free(words[i]);
+    free(words);
+
+    *cur = c;
+    return res;
+}
+
+/*
+ * run a command substitution, only the commands modules build paths with are known
+ */
+int _mii_analysis_tcl_eval(char** words, int num_words, mii_analysis_buf* out) {
+    if (num_words >= 3 && !strcmp(words[0], "file") && !strcmp(words[1], "join")) {
+        size_t start = out->len;
+
+        for (int i = 2; i < num_words; ++i) {
+            /* an absolute part discards everything before it */
+            if (words[i][0] == '/') {
+                out->len = start;
+            } else if (out->len > start && out->data[out->len - 1] != '/') {
+                _mii_analysis_append(out, "/", 1);
+            }
+
+            _mii_analysis_append(out, words[i], strlen(words[i]));
+        }
+
+        return 0;
+    }
+
+    if (num_words == 3 && !strcmp(words[0], "file") && !strcmp(words[1], "dirname")) {
+        const char* slash = strrchr(words[2], '/');
+
+        if (!slash) {
+            _mii_analysis_append(out, ".", 1);
+        } else if (slash == words[2]) {
+            _mii_analysis_append(out, "/", 1);
+        } else {
+            _mii_analysis_append(out, words[2], slash - words[2]);
         }
 
-        free(bin_paths);
-        free(buffer);
+        return 0;
     }
-    if (f != NULL) fclose(f);
-#endif
 
+    mii_debug("Unsupported tcl command substitution [%s]", num_words ? words[0] : "");
+    return -1;
+}
+
+/*
+ * substitute a backslash sequence
+ */
+void _mii_analysis_tcl_backslash(const char** cur, mii_analysis_buf* out) {
+    const char* c = *cur + 1;
+    char ch = *c;
+
+    switch (*c) {
+    case 0:
+        /* a trailing backslash is kept */
+        _mii_analysis_append(out, "\\", 1);
+        *cur = c;
+        return;
+    case 'n':
+        ch = '\n';
+        break;
+    case 't':
+        ch = '\t';
+        break;
+    case '\n':
+        ch = ' ';
+        break;
+    }
+
+    _mii_analysis_append(out, &ch, 1);
+    *cur = c + 1;
+}
+
+/*
+ * look up an environment variable, the module's own setenv calls first
+ */
+const char* _mii_analysis_tcl_getenv(const mii_analysis_tcl_scope* scope, const char* name, size_t name_len) {
+    const char* value = _mii_analysis_vars_get(&scope->env, name, name_len);
+    if (value) return value;
+
+    char* key = malloc(name_len + 1);
+    memcpy(key, name, name_len);
+    key[name_len] = 0;
+
+    /* analysis never changes the environment, so reading it from several threads is safe */
+    value = getenv(key);
+    free(key);
+
+    return value;
+}
+
+/*
+ * interpret one lmod statement, returns the number of PATH changes which couldn't be evaluated
+ */
+int _mii_analysis_lua_statement(mii_analysis_state* s, mii_modtable_entry* mod, mii_analysis_lua_scope* scope, const char* c) {
+    mii_analysis_buf value;
+    int unresolved = 0;
+
+    while (*c) {
+        size_t len = _mii_analysis_lua_name(c);
+
+        if (!len) {
+            /* string contents are never code */
+            const char* start = c;
+
+            memset(&value, 0, sizeof value);
+            if (strchr("\"'[", *c)) _mii_analysis_lua_string(&c, &value);
+            free(value.data);
+
+            if (c == start) ++c;
+            continue;
+        }
+
+        const char* name = c;
+        for (c += len; isspace((unsigned char) *c); ++c);
+
+        if (*c == '=' && c[1] != '=' && !memchr(name, '.', len)) {
+            /* a value which can't be evaluated hides the previous one */
+            char* key = malloc(len + 1);
+            memcpy(key, name, len);
+            key[len] = 0;
+
+            ++c;
+            memset(&value, 0, sizeof value);
+
+            if (_mii_analysis_lua_expr(&c, scope, &value)) {
+                free(value.data);
+                value.data = NULL;
+            } else {
+                _mii_analysis_append(&value, "", 1);
+            }
+
+            _mii_analysis_vars_set(&scope->vars, key, value.data);
+            free(key);
+        } else if (*c == '(' || *c == '{') {
+            unresolved += _mii_analysis_lua_call(s, mod, scope, name, len, &c);
+        }
+    }
+
+    return unresolved;
+}
+
+/*
+ * evaluate prepend_path, append_path, setenv and pushenv calls, in the argument list or table form
+ * other calls are left for the statement scan to look into
+ */
+int _mii_analysis_lua_call(mii_analysis_state* s, mii_modtable_entry* mod, mii_analysis_lua_scope* scope, const char* name, size_t name_len, const char** cur) {
+    int path = (name_len == 12 && !strncmp(name, "prepend_path", 12)) || (name_len == 11 && !strncmp(name, "append_path", 11));
+    int env = (name_len == 6 && !strncmp(name, "setenv", 6)) || (name_len == 7 && !strncmp(name, "pushenv", 7));
+    int unresolved = 0, num_args;
+    char** args;
+
+    if (!path && !env) return 0;
+
+    if (_mii_analysis_lua_args(cur, scope, &args, &num_args)) return path;
+
+    if (env) {
+        if (num_args >= 2 && args[0]) {
+            _mii_analysis_vars_set(&scope->env, args[0], args[1]);
+            args[1] = NULL;
+        }
+    } else if (num_args >= 1 && !args[0]) {
+        unresolved = 1;
+    } else if (num_args >= 2 && !strcmp(args[0], "PATH")) {
+        if (args[1]) _mii_analysis_scan_path(s->cache, args[1], mod);
+        else unresolved = 1;
+    } else if (num_args >= 2 && args[1] && !strcmp(args[0], "MODULEPATH")) {
+        _mii_analysis_add_use(mod, args[1]);
+    }
+
+    _mii_analysis_lua_free_args(args, num_args);
+    return unresolved;
+}
+
+/*
+ * evaluate the arguments of a call starting at ( or {, arguments which can't be evaluated are NULL
+ * named table fields are skipped, returns -1 if the list isn't closed
+ */
+int _mii_analysis_lua_args(const char** cur, const mii_analysis_lua_scope* scope, char*** args_out, int* num_args_out) {
+    const char* c = *cur;
+    char close = (*c == '(') ? ')' : '}';
+
+    *args_out = NULL;
+    *num_args_out = 0;
+
+    for (++c;; ++c) {
+        while (isspace((unsigned char) *c)) ++c;
+        if (*c == close) break;
+
+        size_t len = _mii_analysis_lua_name(c);
+        const char* after = c + len;
+        while (isspace((unsigned char) *after)) ++after;
+
+        int named = len && *after == '=' && after[1] != '=';
+        if (named) c = after + 1;
+
+        mii_analysis_buf value = {0};
+
+        if (_mii_analysis_lua_expr(&c, scope, &value)) {
+            _mii_analysis_lua_skip(&c);
+            free(value.data);
+            value.data = NULL;
+        } else {
+            _mii_analysis_append(&value, "", 1);
+        }
+
+        if (named) {
+            free(value.data);
+        } else {
+            *args_out = realloc(*args_out, (*num_args_out + 1) * sizeof **args_out);
+            (*args_out)[(*num_args_out)++] = value.data;
+        }
+
+        while (isspace((unsigned char) *c)) ++c;
+
+        if (*c == close) break;
+
+        if (*c != ',' && *c != ';') {
+            _mii_analysis_lua_free_args(*args_out, *num_args_out);
+            *cur = c;
+            return -1;
+        }
+    }
+
+    *cur = c + 1;
     return 0;
 }
 
 /*
- * extract paths from a tcl file
+ * evaluate a string expression, terms joined with ..
+ * returns -1 if a term can't be evaluated or the expression goes on with other operators
  */
-int _mii_analysis_tcl(const char* path, char*** bins_out, int* num_bins_out) {
-    char linebuf[MII_ANALYSIS_LINEBUF_SIZE];
+int _mii_analysis_lua_expr(const char** cur, const mii_analysis_lua_scope* scope, mii_analysis_buf* out) {
+    const char* c = *cur;
 
-    FILE* f = fopen(path, "r");
+    while (1) {
+        if (_mii_analysis_lua_term(&c, scope, out)) {
+            *cur = c;
+            return -1;
+        }
 
-    if (!f) {
-        mii_error("Couldn't open %s for reading : %s", path, strerror(errno));
-        return -1;
+        while (isspace((unsigned char) *c)) ++c;
+
+        if (c[0] != '.' || c[1] != '.' || c[2] == '.') break;
+        c += 2;
     }
 
-    char* cmd, *key, *val, *expanded;
+    *cur = c;
 
-    while (fgets(linebuf, sizeof linebuf, f)) {
-        /* strip off newline */
-        int len = strlen(linebuf);
-        if (linebuf[len - 1] == '\n') linebuf[len - 1] = 0;
+    if (!*c || strchr(",;)}", *c)) return 0;
 
-        if (!(cmd = strtok(linebuf, " \t"))) continue;
+    /* another statement can follow on the same line, but not a boolean operator */
+    size_t len = _mii_analysis_lua_name(c);
+    if (!len || (len == 3 && !strncmp(c, "and", 3)) || (len == 2 && !strncmp(c, "or", 2))) return -1;
 
-        if (*cmd == '#') continue; /* skip comments */
+    return 0;
+}
 
-        if (!strcmp(cmd, "set")) {
-            if (!(key = strtok(NULL, " \t"))) continue;
-            if (!(val = strtok(NULL, " \t"))) continue;
-            if (!(expanded = _mii_analysis_expand(val))) continue;
+/*
+ * evaluate a string literal, number, local variable, parenthesized expression or known function call
+ */
+int _mii_analysis_lua_term(const char** cur, const mii_analysis_lua_scope* scope, mii_analysis_buf* out) {
+    const char* c = *cur;
+
+    while (isspace((unsigned char) *c)) ++c;
+    *cur = c;
+
+    if (*c == '"' || *c == '\'' || *c == '[') return _mii_analysis_lua_string(cur, out);
+
+    if (*c == '(') {
+        ++c;
 
-            setenv(key, expanded, 1);
-            free(expanded);
-        } else if (!strcmp(cmd, "prepend-path") || !strcmp(cmd, "append-path")) {
-            if (!(key = strtok(NULL, " \t"))) continue;
-            if (strcmp(key, "PATH")) continue;
+        int res = _mii_analysis_lua_expr(&c, scope, out);
+        *cur = c;
 
-            if (!(val = strtok(NULL, " \t"))) continue;
-            if (!(expanded = _mii_analysis_expand(val))) continue;
+        if (res || *c != ')') return -1;
+
+        *cur = c + 1;
+        return 0;
+    }
 
-            _mii_analysis_scan_path(expanded, bins_out, num_bins_out);
-            free(expanded);
+    if (isdigit((unsigned char) *c)) {
+        /* numbers are concatenated as written */
+        while (isalnum((unsigned char) *c) || (*c == '.' && c[1] != '.')) ++c;
+
+        _mii_analysis_append(out, *cur, c - *cur);
+        *cur = c;
+        return 0;
+    }
+
+    size_t len = _mii_analysis_lua_name(c);
+    if (!len) return -1;
+
+    const char* name = c, *after = c + len;
+    while (isspace((unsigned char) *after)) ++after;
+
+    if (*after == '(') {
+        char** args;
+        int num_args, res;
+
+        if (_mii_analysis_lua_args(&after, scope, &args, &num_args)) {
+            *cur = after;
+            return -1;
+        }
+
+        res = _mii_analysis_lua_function(name, len, args, num_args, scope, out);
+        _mii_analysis_lua_free_args(args, num_args);
+
+        *cur = after;
+        return res;
+    }
+
+    *cur = c + len;
+
+    /* fields of tables aren't tracked */
+    const char* value = memchr(name, '.', len) ? NULL : _mii_analysis_vars_get(&scope->vars, name, len);
+    if (!value) return -1;
+
+    _mii_analysis_append(out, value, strlen(value));
+    return 0;
+}
+
+/*
+ * call a function modulefiles commonly build paths with
+ */
+int _mii_analysis_lua_function(const char* name, size_t name_len, char** args, int num_args, const mii_analysis_lua_scope* scope, mii_analysis_buf* out) {
+    for (int i = 0; i < num_args; ++i) {
+        if (!args[i]) return -1;
+    }
+
+    if (name_len == 8 && !strncmp(name, "pathJoin", 8)) {
+        _mii_analysis_lua_path_join(args, num_args, out);
+        return 0;
+    }
+
+    if (name_len == 9 && !strncmp(name, "os.getenv", 9) && num_args == 1) {
+        const char* value = _mii_analysis_vars_get(&scope->env, args[0], strlen(args[0]));
+
+        /* analysis never changes the environment, so reading it from several threads is safe */
+        if (!value) value = getenv(args[0]);
+
+        /* unset variables are empty, like in the sandbox */
+        if (value) _mii_analysis_append(out, value, strlen(value));
+        return 0;
+    }
+
+    if (name_len > 8 && !strncmp(name, "myModule", 8) && !num_args) {
+        const char* code = scope->mod->code, *version = strrchr(code, '/');
+        name += 8;
+        name_len -= 8;
+
+        if (name_len == 8 && !strncmp(name, "FullName", 8)) {
+            _mii_analysis_append(out, code, strlen(code));
+        } else if (name_len == 4 && !strncmp(name, "Name", 4)) {
+            _mii_analysis_append(out, code, version ? (size_t) (version - code) : strlen(code));
+        } else if (name_len == 7 && !strncmp(name, "Version", 7)) {
+            if (version) _mii_analysis_append(out, version + 1, strlen(version + 1));
+        } else {
+            return -1;
         }
+
+        return 0;
     }
 
-    fclose(f);
+    return -1;
+}
+
+/*
+ * read a quoted or long bracket string, returns -1 if there's no complete string at <cur>
+ */
+int _mii_analysis_lua_string(const char** cur, mii_analysis_buf* out) {
+    const char* c = *cur;
+
+    if (*c == '[') {
+        size_t level = 0;
+
+        while (c[1 + level] == '=') ++level;
+        if (c[1 + level] != '[') return -1;
+
+        c += level + 2;
+
+        /* a line break right after the opening bracket isn't part of the string */
+        if (*c == '\n') ++c;
+
+        for (const char* start = c; *c; ++c) {
+            if (*c != ']') continue;
+
+            size_t i = 0;
+            while (i < level && c[1 + i] == '=') ++i;
+
+            if (i == level && c[1 + level] == ']') {
+                _mii_analysis_append(out, start, c - start);
+                *cur = c + level + 2;
+                return 0;
+            }
+        }
+
+        *cur = c;
+        return -1;
+    }
+
+    char quote = *c++, ch;
+
+    while (*c != quote) {
+        const char* start = c;
+        while (*c && *c != quote && *c != '\\') ++c;
+        _mii_analysis_append(out, start, c - start);
+
+        if (*c != '\\') break;
+
+        switch (*++c) {
+        case 0:
+            *cur = c;
+            return -1;
+        case 'n':
+            ch = '\n';
+            break;
+        case 't':
+            ch = '\t';
+            break;
+        default:
+            ch = *c;
+
+            if (isdigit((unsigned char) ch)) {
+                /* decimal escapes take up to three digits */
+                int code = 0;
+                for (int i = 0; i < 3 && isdigit((unsigned char) *c); ++i) code = code * 10 + *c++ - '0';
+                ch = (char) code;
+                --c;
+            }
+        }
+
+        _mii_analysis_append(out, &ch, 1);
+        ++c;
+    }
+
+    *cur = c;
+    if (!*c) return -1;
+
+    ++*cur;
     return 0;
 }
 
 /*
- * scan a path for commands
+ * join paths like Lmod's pathJoin, empty and . segments are dropped
  */
-int _mii_analysis_scan_path(char* path, char*** bins_out, int* num_bins_out) {
+void _mii_analysis_lua_path_join(char** args, int num_args, mii_analysis_buf* out) {
+    int absolute = num_args && args[0][strspn(args[0], " \t")] == '/', first = 1;
+
+    for (int i = 0; i < num_args; ++i) {
+        const char* c = args[i], *end = c + strlen(c);
+
+        while (isspace((unsigned char) *c)) ++c;
+        while (end > c && isspace((unsigned char) end[-1])) --end;
+
+        while (c < end) {
+            const char* segment = c;
+            while (c < end && *c != '/') ++c;
+
+            size_t len = c - segment;
+
+            if (len && (len != 1 || *segment != '.')) {
+                if (!first || absolute) _mii_analysis_append(out, "/", 1);
+                _mii_analysis_append(out, segment, len);
+                first = 0;
+            }
+
+            if (c < end) ++c;
+        }
+    }
+
+    if (first && absolute) _mii_analysis_append(out, "/", 1);
+}
+
+/*
+ * skip to the end of an argument which couldn't be evaluated
+ */
+void _mii_analysis_lua_skip(const char** cur) {
+    const char* c = *cur;
+    mii_analysis_buf ignored = {0};
+    int depth = 0;
+
+    while (*c) {
+        if (strchr("\"'[", *c) && !_mii_analysis_lua_string(&c, &ignored)) {
+            ignored.len = 0;
+            continue;
+        }
+
+        if (strchr("({[", *c)) {
+            ++depth;
+        } else if (strchr(")}]", *c)) {
+            if (!depth--) break;
+        } else if ((*c == ',' || *c == ';') && !depth) {
+            break;
+        }
+
+        ++c;
+    }
+
+    free(ignored.data);
+    *cur = c;
+}
+
+void _mii_analysis_lua_free_args(char** args, int num_args) {
+    for (int i = 0; i < num_args; ++i) free(args[i]);
+    free(args);
+}
+
+/*
+ * length of the name at <c>, dotted names like os.getenv are one name
+ */
+size_t _mii_analysis_lua_name(const char* c) {
+    const char* start = c;
+
+    if (!isalpha((unsigned char) *c) && *c != '_') return 0;
+
+    while (isalnum((unsigned char) *c) || *c == '_' || (*c == '.' && (isalpha((unsigned char) c[1]) || c[1] == '_'))) ++c;
+
+    return c - start;
+}
+
+/*
+ * scan a path for commands, recording each directory with its mtime
+ * directories which were scanned for another module are copied from the cache
+ */
+int _mii_analysis_scan_path(mii_analysis_cache* cache, char* path, mii_modtable_entry* mod) {
     /* paths might contain multiple in one (separated by ':'),
      * break them up here */
 
+    char* saveptr;
+
+    for (const char* cur_path = strtok_r(path, ":", &saveptr); cur_path; cur_path = strtok_r(NULL, ":", &saveptr)) {
+        const mii_analysis_path* p = _mii_analysis_cache_stat(cache, cur_path);
+        const mii_analysis_scan* scan = p->found ? _mii_analysis_cache_scan(cache, p) : NULL;
+
+        /* missing directories are kept too, so a sync notices when they appear */
+        mod->dirs = realloc(mod->dirs, (mod->num_dirs + 1) * sizeof *mod->dirs);
+
+        mii_modtable_bin_dir* dir = mod->dirs + mod->num_dirs++;
+
+        dir->path = mii_strdup(cur_path);
+        dir->mtime.tv_sec = -1;
+        dir->mtime.tv_nsec = 0;
+        dir->num_bins = 0;
+
+        if (!scan) continue;
+
+        dir->mtime = p->mtime;
+        dir->num_bins = scan->num_bins;
+
+        _mii_analysis_copy_bins(scan, &mod->bins, &mod->num_bins);
+    }
+
+    return 0;
+}
+
+/*
+ * remember the MODULEPATH directories in <path>, without trailing slashes so they compare like roots
+ */
+void _mii_analysis_add_use(mii_modtable_entry* mod, char* path) {
+    char* saveptr;
+
+    for (char* cur_path = strtok_r(path, ":", &saveptr); cur_path; cur_path = strtok_r(NULL, ":", &saveptr)) {
+        size_t len = strlen(cur_path);
+        int known = 0;
+
+        while (len > 1 && cur_path[len - 1] == '/') cur_path[--len] = 0;
+
+        for (int i = 0; i < mod->num_uses && !known; ++i) known = !strcmp(mod->uses[i], cur_path);
+        if (known) continue;
+
+        mod->uses = realloc(mod->uses, (mod->num_uses + 1) * sizeof *mod->uses);
+        mod->uses[mod->num_uses++] = mii_strdup(cur_path);
+    }
+}
+
+/*
+ * append copies of a scanned directory's commands
+ */
+void _mii_analysis_copy_bins(const mii_analysis_scan* scan, char*** bins_out, int* num_bins_out) {
+    if (!scan->num_bins) return;
+
+    *bins_out = realloc(*bins_out, (*num_bins_out + scan->num_bins) * sizeof **bins_out);
+
+    for (int i = 0; i < scan->num_bins; ++i) {
+        (*bins_out)[(*num_bins_out)++] = mii_strdup(scan->bins[i]);
+    }
+}
+
+/*
+ * list the commands in one directory
+ */
+void _mii_analysis_scan_dir(const char* path, char*** bins_out, int* num_bins_out) {
     DIR* d;
     struct dirent* dp;
     struct stat st;
 
-    for (const char* cur_path = strtok(path, ":"); cur_path; cur_path = strtok(NULL, ":")) {
-        mii_debug("scanning PATH %s", cur_path);
+    if (!(d = opendir(path))) {
+        mii_debug("Failed to open %s, ignoring : %s", path, strerror(errno));
+        return;
+    }
+
+    /* entries are resolved relative to the open directory, most need no stat at all */
+    int dfd = dirfd(d);
+
+    while ((dp = readdir(d))) {
+        if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..")) continue;
 
-        /* TODO: this could be faster, do some benchmarking to see if it's actually slow */
-        if (!(d = opendir(cur_path))) {
-            mii_debug("Failed to open %s, ignoring : %s", cur_path, strerror(errno));
+        st.st_mode = mii_dirent_mode(dp);
+
+        if (!st.st_mode && fstatat(dfd, dp->d_name, &st, 0)) {
+            mii_warn("Couldn't stat %s/%s : %s", path, dp->d_name, strerror(errno));
             continue;
         }
 
-        while ((dp = readdir(d))) {
-            if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..")) continue;
+        /* check the file is executable by the user */
+        if (S_ISREG(st.st_mode) && !faccessat(dfd, dp->d_name, X_OK, 0)) {
+            /* found a binary! append it to the list */
+            ++*num_bins_out;
+            *bins_out = realloc(*bins_out, *num_bins_out * sizeof **bins_out);
+            (*bins_out)[*num_bins_out - 1] = mii_strdup(dp->d_name);
+        }
+    }
+
+    closedir(d);
+}
 
-            char* abs_path = mii_join_path(cur_path, dp->d_name);
+/*
+ * stat a PATH entry once per cache, entries are never changed once added
+ */
+const mii_analysis_path* _mii_analysis_cache_stat(mii_analysis_cache* c, const char* path) {
+    int ind = XXH32(path, strlen(path), 0) % MII_ANALYSIS_CACHE_WIDTH;
+    mii_analysis_path* cur;
 
-            if (!stat(abs_path, &st)) {
-                /* check the file is executable by the user */
-                if ((S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) && !access(abs_path, X_OK)) {
-                    /* found a binary! append it to the list */
-                    ++*num_bins_out;
-                    *bins_out = realloc(*bins_out, *num_bins_out * sizeof **bins_out);
-                    (*bins_out)[*num_bins_out - 1] = mii_strdup(dp->d_name);
-                }
-            } else {
-                mii_warn("Couldn't stat %s : %s", abs_path, strerror(errno));
-            }
+    pthread_mutex_lock(&c->lock);
+    for (cur = c->paths[ind]; cur && strcmp(cur->path, path); cur = cur->next);
+    pthread_mutex_unlock(&c->lock);
 
-            free(abs_path);
-        }
+    if (cur) return cur;
+
+    struct stat st;
+    mii_analysis_path* entry = calloc(1, sizeof *entry);
 
-        closedir(d);
+    entry->path = mii_strdup(path);
+
+    if (stat(path, &st)) {
+        mii_debug("Failed to stat %s, ignoring : %s", path, strerror(errno));
+    } else {
+        entry->found = 1;
+        entry->dev = st.st_dev;
+        entry->ino = st.st_ino;
+        entry->mtime = st.st_mtim;
     }
 
-    return 0;
+    /* another thread may have added it meanwhile, the first one stays */
+    pthread_mutex_lock(&c->lock);
+
+    for (cur = c->paths[ind]; cur && strcmp(cur->path, path); cur = cur->next);
+
+    if (!cur) {
+        entry->next = c->paths[ind];
+        c->paths[ind] = cur = entry;
+        entry = NULL;
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    if (entry) {
+        free(entry->path);
+        free(entry);
+    }
+
+    return cur;
 }
 
-char* _mii_analysis_expand(const char* expr) {
-    wordexp_t w;
+/*
+ * find the commands in a directory which was found, scanning it if no module did yet
+ * entries are never changed once added
+ */
+const mii_analysis_scan* _mii_analysis_cache_scan(mii_analysis_cache* c, const mii_analysis_path* path) {
+    int ind = (path->ino ^ path->dev) % MII_ANALYSIS_CACHE_WIDTH;
+    mii_analysis_scan* cur;
 
-    if (wordexp(expr, &w, WRDE_NOCMD)) {
-        /* expansion failed. die quietly */
-        mii_debug("Expansion failed on string \"%s\"!", expr);
-        return NULL;
+    pthread_mutex_lock(&c->lock);
+    for (cur = c->buf[ind]; cur && (cur->ino != path->ino || cur->dev != path->dev); cur = cur->next);
+    if (cur) ++c->hits;
+    pthread_mutex_unlock(&c->lock);
+
+    if (cur) return cur;
+
+    mii_analysis_scan* scan = calloc(1, sizeof *scan);
+
+    scan->dev = path->dev;
+    scan->ino = path->ino;
+
+    mii_debug("scanning PATH %s", path->path);
+    _mii_analysis_scan_dir(path->path, &scan->bins, &scan->num_bins);
+
+    /* another thread may have scanned it meanwhile, the first scan stays */
+    pthread_mutex_lock(&c->lock);
+
+    for (cur = c->buf[ind]; cur && (cur->ino != path->ino || cur->dev != path->dev); cur = cur->next);
+
+    if (!cur) {
+        scan->next = c->buf[ind];
+        c->buf[ind] = cur = scan;
+        scan = NULL;
+        ++c->misses;
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    if (scan) {
+        for (int i = 0; i < scan->num_bins; ++i) free(scan->bins[i]);
+        free(scan->bins);
+        free(scan);
+    }
+
+    return cur;
+}
+
+void _mii_analysis_append(mii_analysis_buf* buf, const char* str, size_t n) {
+    if (buf->len + n > buf->capacity) {
+        while (buf->len + n > buf->capacity) buf->capacity = buf->capacity ? buf->capacity * 2 : 64;
+        buf->data = realloc(buf->data, buf->capacity);
     }
 
-    char* output = NULL;
-    int len = 0;
+    memcpy(buf->data + buf->len, str, n);
+    buf->len += n;
+}
 
-    for (int i = 0; i < w.we_wordc; ++i) {
-        int wsize = strlen(w.we_wordv[i]);
-        len += wsize;
-        output = realloc(output, len + 1);
-        memcpy(output + len - wsize, w.we_wordv[i], len + 1);
+/*
+ * set a module variable, taking ownership of <value>
+ */
+void _mii_analysis_vars_set(mii_analysis_vars* vars, const char* key, char* value) {
+    for (int i = 0; i < vars->count; ++i) {
+        if (!strcmp(vars->keys[i], key)) {
+            free(vars->values[i]);
+            vars->values[i] = value;
+            return;
+        }
     }
 
-    wordfree(&w);
-    return output;
+    ++vars->count;
+    vars->keys = realloc(vars->keys, vars->count * sizeof *vars->keys);
+    vars->values = realloc(vars->values, vars->count * sizeof *vars->values);
+    vars->keys[vars->count - 1] = mii_strdup(key);
+    vars->values[vars->count - 1] = value;
+}
+
+/*
+ * find a module variable by the first <key_len> bytes of <key>, NULL if it isn't set
+ */
+const char* _mii_analysis_vars_get(const mii_analysis_vars* vars, const char* key, size_t key_len) {
+    for (int i = 0; i < vars->count; ++i) {
+        if (strlen(vars->keys[i]) == key_len && !strncmp(vars->keys[i], key, key_len)) return vars->values[i];
+    }
+
+    return NULL;
+}
+
+void _mii_analysis_vars_free(mii_analysis_vars* vars) {
+    for (int i = 0; i < vars->count; ++i) {
+        free(vars->keys[i]);
+        free(vars->values[i]);
+    }
+
+    free(vars->keys);
+    free(vars->values);
 }
 
 #if MII_ENABLE_SPIDER
 
-/* parse the json and fill module info */
-int mii_analysis_parse_module_json(const cJSON* mod_json, mii_modtable_entry* mod) {
+/*
+ * parse the json and fill module info
+ * <prev> is the module's entry in the previous index or NULL, if the modulefile didn't change
+ * since then its bins and PATH directories move over and 1 is returned instead of scanning pathA
+ */
+int mii_analysis_parse_module_json(mii_analysis_cache* cache, const cJSON* mod_json, mii_modtable_entry* mod, mii_modtable_entry* prev) {
     /* stat the type */
     struct stat st;
     if (stat(mod_json->string, &st) != 0) {
@@ -369,7 +1567,7 @@ int mii_analysis_parse_module_json(const cJSON* mod_json, mii_modtable_entry* mo
         return -1;
     }
 
-    /* get the parents */
+    /* get the parents, spider always knows them so they aren't taken from the previous index */
     cJSON* parents_arrs = cJSON_GetObjectItemCaseSensitive(mod_json, "parentAA");
     if(_mii_analysis_parents_from_json(parents_arrs, &mod->parents, &mod->num_parents)) {
         mii_error("Couldn't get parents from JSON!");
@@ -379,18 +1577,37 @@ int mii_analysis_parse_module_json(const cJSON* mod_json, mii_modtable_entry* mo
     /* fill up some of the info */
     mod->bins = NULL;
     mod->num_bins = 0;
+    mod->dirs = NULL;
+    mod->num_dirs = 0;
+    mod->uses = NULL; /* spider already followed the hierarchy */
+    mod->num_uses = 0;
+    mod->root = -1;
     mod->path = mii_strdup(mod_json->string);
     mod->type = MII_MODTABLE_MODTYPE_LMOD;
     mod->timestamp = st.st_mtime;
     mod->code = mii_strdup(code->valuestring);
     mod->analysis_complete = 1;
 
+    if (prev && st.st_mtime <= prev->timestamp) {
+        /* up to date, the caller checks the PATH directories for changes */
+        mod->bins = prev->bins;
+        mod->num_bins = prev->num_bins;
+        mod->dirs = prev->dirs;
+        mod->num_dirs = prev->num_dirs;
+
+        prev->bins = NULL;
+        prev->dirs = NULL;
+        prev->num_bins = prev->num_dirs = 0;
+
+        return 1;
+    }
+
     /* get the bins */
     cJSON* bin_paths = cJSON_GetObjectItemCaseSensitive(mod_json, "pathA");
     if (bin_paths != NULL) {
         for (cJSON* path = bin_paths->child; path != NULL; path = path->next) {
             /* analyze the bin paths */
-            _mii_analysis_scan_path(path->string, &mod->bins, &mod->num_bins);
+            _mii_analysis_scan_path(cache, path->string, mod);
         }
     }
 
@@ -1,26 +1,106 @@
 #ifndef MII_ANALYSIS_H
 #define MII_ANALYSIS_H
 
+#include "modtable.h"
+
 #if MII_ENABLE_SPIDER
 #include "cjson/cJSON.h"
-#include "modtable.h"
 #endif
 
-#define MII_ANALYSIS_LINEBUF_SIZE 512
+#if MII_ENABLE_LUA
+#include <lua.h>
+#endif
+
+#include <pthread.h>
+#include <sys/types.h>
+
+/* modulo for the scanned directory hashtable */
+#define MII_ANALYSIS_CACHE_WIDTH 1024
 
 /*
  * analysis.h
  *
  * functions for analyzing module files and extracting command names
+ * analysis is re-entrant, each thread analyzing modules needs its own state
+ */
+
+/* commands found in one PATH directory */
+typedef struct _mii_analysis_scan {
+    dev_t dev;
+    ino_t ino;
+    char** bins;
+    int num_bins;
+    struct _mii_analysis_scan* next;
+} mii_analysis_scan;
+
+/* a PATH entry as spelled by modules, stat()ed once */
+typedef struct _mii_analysis_path {
+    char* path;
+    int found;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct _mii_analysis_path* next;
+} mii_analysis_path;
+
+/*
+ * PATH directories scanned so far, shared by every state analyzing one table
+ * directories are keyed by device and inode, so each is read once however modules spell it
  */
+typedef struct _mii_analysis_cache {
+    mii_analysis_scan* buf[MII_ANALYSIS_CACHE_WIDTH];
+    mii_analysis_path* paths[MII_ANALYSIS_CACHE_WIDTH];
+    int hits, misses;
+    pthread_mutex_t lock;
+} mii_analysis_cache;
+
+/* how a module's PATH changes were found */
+#define MII_ANALYSIS_TIER_STATIC     0 /* evaluated without running the modulefile */
+#define MII_ANALYSIS_TIER_SANDBOX    1 /* the modulefile was run in the Lua sandbox */
+#define MII_ANALYSIS_TIER_UNRESOLVED 2 /* some PATH changes couldn't be evaluated */
+#define MII_ANALYSIS_TIER_TIMEOUT    3 /* the sandbox run went over its budget */
+#define MII_ANALYSIS_NUM_TIERS       4
+
+/* default sandbox budget for each module */
+#define MII_ANALYSIS_LUA_INSTRUCTIONS 10000000
+#define MII_ANALYSIS_LUA_MEMORY       64 /* MiB */
+
+#if MII_ENABLE_LUA
+/* memory used by a sandbox, allocations past the limit fail */
+typedef struct _mii_analysis_lua_heap {
+    size_t used, limit; /* no limit if 0 */
+    int exceeded; /* truthy once the running module went over its budget */
+} mii_analysis_lua_heap;
+#endif
+
+typedef struct _mii_analysis_state {
+#if MII_ENABLE_LUA
+    lua_State* lua_state; /* this state's sandbox, started for the first module the static pass can't resolve */
+    mii_analysis_lua_heap lua_heap;
+    int lua_failed;
+#endif
+    mii_analysis_cache* cache;
+    int tiers[MII_ANALYSIS_NUM_TIERS]; /* modules analyzed by each tier */
+} mii_analysis_state;
+
+/* limit what each module may run and allocate in the sandbox, 0 for no limit, set before any analysis */
+void mii_analysis_lua_budget(int instructions, int memory);
+
+void mii_analysis_cache_init(mii_analysis_cache* c);
+void mii_analysis_cache_free(mii_analysis_cache* c);
+
+int mii_analysis_init(mii_analysis_state* s, mii_analysis_cache* cache);
+void mii_analysis_free(mii_analysis_state* s);
 
-int mii_analysis_init();
-void mii_analysis_free();
+/* fill the bins and PATH directories of a module from its modulefile */
+int mii_analysis_run(mii_analysis_state* s, mii_modtable_entry* mod);
 
-int mii_analysis_run(const char* modfile, int modtype, char*** bins_out, int* num_bins_out);
+/* scan the PATH directories of an analyzed module again if they changed, truthy if its bins were patched */
+int mii_analysis_refresh(mii_analysis_state* s, mii_modtable_entry* mod);
 
 #if MII_ENABLE_SPIDER
-int mii_analysis_parse_module_json(const cJSON* mod_json, mii_modtable_entry* mod);
+/* fill a module from its spider-json record, 1 if the bins of <prev> were still current and moved over */
+int mii_analysis_parse_module_json(mii_analysis_cache* cache, const cJSON* mod_json, mii_modtable_entry* mod, mii_modtable_entry* prev);
 #endif
 
 #endif
@@ -0,0 +1,891 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "index.h"
+#include "modtable.h"
+#include "log.h"
+#include "util.h"
+
+#include "xxhash/xxhash.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* identify the v2 index format, the first two bytes differ from the legacy format */
+static const unsigned char MII_INDEX_MAGIC_BYTES[] = { 0xBE, 0xE6, 'M', 'I' };
+static const unsigned char MII_INDEX_LEGACY_MAGIC_BYTES[] = { 0xBE, 0xE5 };
+
+/* growable byte buffer used to assemble sections */
+typedef struct _mii_index_buf {
+    char* data;
+    size_t size, cap;
+} mii_index_buf;
+
+/* string pool with deduplication */
+typedef struct _mii_index_pool {
+    mii_index_buf buf;
+    uint32_t* slots; /* pool offset + 1, 0 marks an empty slot */
+    uint32_t num_slots, num_strings;
+} mii_index_pool;
+
+/* (command, module) pair collected while flattening, sorted into postings */
+typedef struct _mii_index_pair {
+    uint32_t name, module;
+} mii_index_pair;
+
+/* BK-tree node while building, children are kept in sibling lists */
+typedef struct _mii_index_bknode {
+    uint32_t command, name, distance, first_child, next_sibling; /* 0 terminates the lists */
+} mii_index_bknode;
+
+void _mii_index_build_commands(mii_index_pool* strings, mii_index_buf* pairs, mii_index_buf* commands, mii_index_buf* postings);
+void _mii_index_build_names(mii_index_pool* strings, mii_index_buf* modules, mii_index_buf* parent_ids, mii_index_buf* names);
+void _mii_index_build_fuzzy(mii_index_pool* strings, mii_index_buf* commands, mii_index_buf* fuzzy);
+int _mii_index_fuzzy_node_compare(const void* a, const void* b);
+int _mii_index_pair_compare(const void* a, const void* b);
+int _mii_index_offset_compare(const void* a, const void* b);
+
+void _mii_index_buf_append(mii_index_buf* b, const void* data, size_t len);
+void _mii_index_buf_pad(mii_index_buf* b);
+void _mii_index_buf_free(mii_index_buf* b);
+
+void _mii_index_pool_init(mii_index_pool* pool);
+uint32_t _mii_index_pool_intern(mii_index_pool* pool, const char* str);
+void _mii_index_pool_free(mii_index_pool* pool);
+
+const void* _mii_index_get_section(mii_index* idx, const mii_index_header* hdr, int id, size_t elem_size, uint32_t* count);
+int _mii_index_check(mii_index* idx, uint32_t num_parent_sets);
+int _mii_index_check_range(uint32_t start, uint32_t count, uint32_t size);
+int _mii_index_check_strings(mii_index* idx, const uint32_t* offsets, uint32_t count);
+
+/*
+ * map an index file into memory
+ * returns MII_INDEX_LEGACY without mapping if the file is in the legacy format
+ */
+int mii_index_map(mii_index* idx, const char* path) {
+    struct stat st;
+    memset(idx, 0, sizeof *idx);
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        mii_error("Couldn't open %s for reading: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st)) {
+        mii_error("Couldn't stat %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /* legacy indices can be smaller than a v2 header, check them first */
+    unsigned char magic_seq[sizeof MII_INDEX_MAGIC_BYTES];
+
+    if (read(fd, magic_seq, sizeof magic_seq) != sizeof magic_seq) {
+        mii_error("Couldn't parse from %s: unexpected EOF or read fail", path);
+        close(fd);
+        return -1;
+    }
+
+    if (!memcmp(magic_seq, MII_INDEX_LEGACY_MAGIC_BYTES, sizeof MII_INDEX_LEGACY_MAGIC_BYTES)) {
+        close(fd);
+        return MII_INDEX_LEGACY;
+    }
+
+    if (memcmp(magic_seq, MII_INDEX_MAGIC_BYTES, sizeof magic_seq) || (size_t) st.st_size < sizeof(mii_index_header)) {
+        mii_error("Couldn't parse from %s: bad magic sequence", path);
+        close(fd);
+        return -1;
+    }
+
+    void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        mii_error("Couldn't map %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    idx->base = base;
+    idx->size = st.st_size;
+
+    const mii_index_header* hdr = base;
+
+    if (hdr->version != MII_INDEX_VERSION) {
+        mii_error("Couldn't parse from %s: unsupported index version %u", path, hdr->version);
+        mii_index_unmap(idx);
+        return -1;
+    }
+
+    /* locate the tables, each section is checked to lie within the file here */
+    idx->strings = _mii_index_get_section(idx, hdr, MII_INDEX_SECTION_STRINGS, 1, &idx->strings_size);
+    idx->modules = _mii_index_get_section(idx, hdr, MII_INDEX_SECTION_MODULES, sizeof *idx->modules, &idx->num_modules);
+    idx->bins = _mii_index_get_section(idx, hdr, MII_INDEX_SECTION_BINS, sizeof *idx->bins, &idx->num_bins);
+    idx->parents = _mii_index_get_section(idx, hdr, MII_INDEX_SECTION_PARENTS, sizeof *idx->parents, &idx->num_parents);
+    idx->commands = _mii_index_get_section(idx, hdr, MII_INDEX_SECTION_COMMANDS, sizeof *idx->commands, &idx->num_commands);
+    idx->postings = _mii_index_get_section(idx, hdr, MII_INDEX_SECTION_POSTINGS, sizeof *idx->postings, &idx->num_postings);
+    idx->fuzzy_nodes = _mii_index_get_section(idx, hdr, MII_INDEX_SECTION_FUZZY, sizeof *idx->fuzzy_nodes, &idx->num_fuzzy_nodes);
+    idx->names = _mii_index_get_section(idx, hdr, MII_INDEX_SECTION_NAMES, sizeof *idx->names, &idx->num_names);
+    idx->parent_ids = _mii_index_get_section(idx, hdr, MII_INDEX_SECTION_PARENT_IDS, sizeof *idx->parent_ids, &idx->num_parent_ids);
+
+    uint32_t num_parent_sets;
+    idx->parent_sets = _mii_index_get_section(idx, hdr, MII_INDEX_SECTION_PARENT_SETS, sizeof *idx->parent_sets, &num_parent_sets);
+    idx->dirs = _mii_index_get_section(idx, hdr, MII_INDEX_SECTION_DIRS, sizeof *idx->dirs, &idx->num_dirs);
+    idx->bin_dirs = _mii_index_get_section(idx, hdr, MII_INDEX_SECTION_BIN_DIRS, sizeof *idx->bin_dirs, &idx->num_bin_dirs);
+
+    /* PATH directories are optional, but must cover every module if present */
+    uint32_t num_module_dirs;
+    idx->module_dirs = _mii_index_get_section(idx, hdr, MII_INDEX_SECTION_MODULE_DIRS, sizeof *idx->module_dirs, &num_module_dirs);
+    if (num_module_dirs < hdr->num_modules) idx->module_dirs = NULL;
+
+    /* MODULEPATH changes are optional the same way */
+    uint32_t num_module_uses;
+    idx->uses = _mii_index_get_section(idx, hdr, MII_INDEX_SECTION_USES, sizeof *idx->uses, &idx->num_uses);
+    idx->module_uses = _mii_index_get_section(idx, hdr, MII_INDEX_SECTION_MODULE_USES, sizeof *idx->module_uses, &num_module_uses);
+    if (num_module_uses < hdr->num_modules) idx->module_uses = NULL;
+
+    /* the pool must be terminated so any in-range offset is a valid string */
+    if (!idx->strings || !idx->strings_size || idx->strings[idx->strings_size - 1] ||
+        (idx->num_modules && !idx->modules) || idx->num_modules != hdr->num_modules ||
+        !idx->commands || (idx->num_commands & (idx->num_commands - 1)) ||
+        !idx->names || (idx->num_names & (idx->num_names - 1)) || (idx->num_parents && !idx->parent_sets) ||
+        _mii_index_check(idx, num_parent_sets)) {
+        mii_error("Couldn't parse from %s: corrupt or truncated index", path);
+        mii_index_unmap(idx);
+        return -1;
+    }
+
+    mii_debug("Mapped index %s : %u modules, %u bins, %u bytes of strings", path, idx->num_modules, idx->num_bins, idx->strings_size);
+    return 0;
+}
+
+/*
+ * check every range and offset stored in the tables once, so queries can follow them unchecked
+ */
+int _mii_index_check(mii_index* idx, uint32_t num_parent_sets) {
+    for (uint32_t i = 0; i < idx->num_modules; ++i) {
+        const mii_index_module* mod = idx->modules + i;
+
+        if (mod->path >= idx->strings_size || mod->code >= idx->strings_size || mod->sort_key >= idx->strings_size ||
+            mod->name_id >= idx->num_names ||
+            _mii_index_check_range(mod->bins, mod->num_bins, idx->num_bins) ||
+            _mii_index_check_range(mod->parents, mod->num_parents, idx->num_parents) ||
+            _mii_index_check_range(mod->parents, mod->num_parents, num_parent_sets)) return -1;
+    }
+
+    if (_mii_index_check_strings(idx, idx->bins, idx->num_bins) ||
+        _mii_index_check_strings(idx, idx->parents, idx->num_parents) ||
+        _mii_index_check_strings(idx, idx->uses, idx->num_uses)) return -1;
+
+    /* probes stop on an empty slot, so a hashtable without one would never end a miss */
+    uint32_t empty_commands = 0, empty_names = 0;
+
+    for (uint32_t i = 0; i < idx->num_commands; ++i) {
+        const mii_index_command* c = idx->commands + i;
+
+        if (!c->num_postings) ++empty_commands;
+        else if (c->name >= idx->strings_size || _mii_index_check_range(c->postings, c->num_postings, idx->num_postings)) return -1;
+    }
+
+    if (!empty_commands) return -1;
+
+    for (uint32_t i = 0; i < idx->num_postings; ++i) {
+        if (idx->postings[i] >= idx->num_modules) return -1;
+    }
+
+    /* the tree is stored breadth-first, so each node's children follow those of the node before */
+    uint32_t next_child = 1;
+
+    for (uint32_t i = 0; i < idx->num_fuzzy_nodes; ++i) {
+        const mii_index_fuzzy_node* node = idx->fuzzy_nodes + i;
+
+        if (node->command >= idx->num_commands || node->name >= idx->strings_size) return -1;
+        if (!node->num_children) continue;
+
+        if (node->children != next_child || _mii_index_check_range(node->children, node->num_children, idx->num_fuzzy_nodes)) return -1;
+        next_child += node->num_children;
+    }
+
+    if (idx->num_fuzzy_nodes && next_child != idx->num_fuzzy_nodes) return -1;
+
+    for (uint32_t i = 0; i < idx->num_names; ++i) {
+        if (!idx->names[i].name) ++empty_names;
+        else if (idx->names[i].name >= idx->strings_size) return -1;
+    }
+
+    if (!empty_names) return -1;
+
+    /* padding can make the parent table look one entry longer than its sets */
+    for (uint32_t i = 0; i < num_parent_sets; ++i) {
+        if (_mii_index_check_range(idx->parent_sets[i].ids, idx->parent_sets[i].num_ids, idx->num_parent_ids)) return -1;
+    }
+
+    for (uint32_t i = 0; i < idx->num_parent_ids; ++i) {
+        if (idx->parent_ids[i] >= idx->num_names) return -1;
+    }
+
+    for (uint32_t i = 0; i < idx->num_dirs; ++i) {
+        if (idx->dirs[i].root >= idx->strings_size || idx->dirs[i].prefix >= idx->strings_size) return -1;
+    }
+
+    for (uint32_t i = 0; i < idx->num_bin_dirs; ++i) {
+        if (idx->bin_dirs[i].path >= idx->strings_size) return -1;
+    }
+
+    for (uint32_t i = 0; idx->module_dirs && i < idx->num_modules; ++i) {
+        if (_mii_index_check_range(idx->module_dirs[i].dirs, idx->module_dirs[i].num_dirs, idx->num_bin_dirs)) return -1;
+    }
+
+    for (uint32_t i = 0; idx->module_uses && i < idx->num_modules; ++i) {
+        if (_mii_index_check_range(idx->module_uses[i].uses, idx->module_uses[i].num_uses, idx->num_uses)) return -1;
+    }
+
+    return 0;
+}
+
+int _mii_index_check_range(uint32_t start, uint32_t count, uint32_t size) {
+    return (start > size || count > size - start) ? -1 : 0;
+}
+
+int _mii_index_check_strings(mii_index* idx, const uint32_t* offsets, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        if (offsets[i] >= idx->strings_size) return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * probe the command hashtable
+ */
+const mii_index_command* mii_index_lookup(mii_index* idx, const char* cmd) {
+    uint32_t hash = XXH32(cmd, strlen(cmd), 0);
+    uint32_t mask = idx->num_commands - 1;
+
+    /* mapping checked that the table has an empty slot, so every probe ends */
+    for (uint32_t slot = hash & mask; idx->commands[slot].num_postings; slot = (slot + 1) & mask) {
+        const mii_index_command* c = idx->commands + slot;
+
+        if (c->hash == hash && !strcmp(mii_index_string(idx, c->name), cmd)) return c;
+    }
+
+    return NULL;
+}
+
+/*
+ * probe the name hashtable
+ */
+uint32_t mii_index_find_name(mii_index* idx, const char* name, size_t len) {
+    uint32_t hash = XXH32(name, len, 0);
+    uint32_t mask = idx->num_names - 1;
+
+    for (uint32_t slot = hash & mask; idx->names[slot].name; slot = (slot + 1) & mask) {
+        const char* cur = mii_index_string(idx, idx->names[slot].name);
+
+        if (idx->names[slot].hash == hash && !strncmp(cur, name, len) && !cur[len]) return slot;
+    }
+
+    return MII_INDEX_NO_NAME;
+}
+
+/*
+ * walk the BK-tree, only descending into subtrees which can hold a match
+ * by the triangle inequality
+ */
+uint32_t mii_index_similar(mii_index* idx, const char* query, int max_distance, uint32_t** nodes_out) {
+    uint32_t num_matches = 0, stack_size = 0;
+
+    *nodes_out = NULL;
+
+    if (!idx->num_fuzzy_nodes) return 0;
+
+    /* every node is pushed and matched at most once */
+    uint32_t* stack = malloc(idx->num_fuzzy_nodes * sizeof *stack);
+    *nodes_out = malloc(idx->num_fuzzy_nodes * sizeof **nodes_out);
+    stack[stack_size++] = 0;
+
+    while (stack_size) {
+        uint32_t cur = stack[--stack_size];
+        const mii_index_fuzzy_node* node = idx->fuzzy_nodes + cur;
+
+        /* past this bound neither the node nor any of its children can match */
+        int max_edge = node->num_children ? idx->fuzzy_nodes[node->children + node->num_children - 1].distance : 0;
+        int dist = mii_damerau_distance_bounded(query, mii_index_string(idx, node->name), max_distance + max_edge);
+
+        if (dist <= max_distance) {
+            (*nodes_out)[num_matches++] = cur;
+        }
+
+        /* a clamped bound only tells us the distance is larger, keep every farther child */
+        int min_edge = dist - max_distance;
+        int last_edge = (dist > MII_DISTANCE_MAX_BOUND) ? INT_MAX : dist + max_distance;
+
+        for (uint32_t i = 0; i < node->num_children; ++i) {
+            int edge = idx->fuzzy_nodes[node->children + i].distance;
+
+            if (edge > last_edge) break;
+            if (edge >= min_edge) stack[stack_size++] = node->children + i;
+        }
+    }
+
+    free(stack);
+
+    return num_matches;
+}
+
+/*
+ * release a mapped index
+ */
+void mii_index_unmap(mii_index* idx) {
+    if (idx->base) munmap(idx->base, idx->size);
+    memset(idx, 0, sizeof *idx);
+}
+
+/*
+ * serialize a mii_modtable into a v2 index
+ * the index is written next to <path> and renamed over it, so processes
+ * which still have the old index mapped are never handed a partial file
+ */
+int mii_index_write(mii_modtable* p, const char* path) {
+    mii_index_pool strings;
+    mii_index_buf modules = {0}, bins = {0}, parents = {0};
+    mii_index_buf pairs = {0}, commands = {0}, postings = {0}, fuzzy = {0};
+    mii_index_buf names = {0}, parent_sets = {0}, parent_ids = {0}, dirs = {0};
+    mii_index_buf bin_dirs = {0}, module_dirs = {0}, uses = {0}, module_uses = {0};
+
+    _mii_index_pool_init(&strings);
+
+    /* flatten the hashtable into fixed-width tables */
+    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
+        for (mii_modtable_entry* cur = p->buf[i]; cur; cur = cur->next) {
+            /* don't write modules that analysis failed for */
+            if (!cur->analysis_complete) continue;
+
+            mii_index_module mod;
+            memset(&mod, 0, sizeof mod);
+
+            mod.path = _mii_index_pool_intern(&strings, cur->path);
+            mod.code = _mii_index_pool_intern(&strings, cur->code);
+
+            char* sort_key = mii_sort_key(cur->code);
+            mod.sort_key = _mii_index_pool_intern(&strings, sort_key);
+            free(sort_key);
+
+            mod.name_id = mod.code; /* resolved to an id once every name is known */
+            mod.type = cur->type;
+            mod.timestamp = cur->timestamp;
+
+            mod.bins = bins.size / sizeof(uint32_t);
+            mod.num_bins = cur->num_bins;
+
+            for (int j = 0; j < cur->num_bins; ++j) {
+                mii_index_pair pair;
+
+                pair.name = _mii_index_pool_intern(&strings, cur->bins[j]);
+                pair.module = modules.size / sizeof(mii_index_module);
+
+                _mii_index_buf_append(&bins, &pair.name, sizeof pair.name);
+                _mii_index_buf_append(&pairs, &pair, sizeof pair);
+            }
+
+            mod.parents = parents.size / sizeof(uint32_t);
+            mod.num_parents = cur->num_parents;
+
+            for (int j = 0; j < cur->num_parents; ++j) {
+                uint32_t off = _mii_index_pool_intern(&strings, cur->parents[j]);
+                _mii_index_buf_append(&parents, &off, sizeof off);
+
+                /* the set holds name offsets until the ids are resolved */
+                mii_index_parent_set set;
+                set.ids = parent_ids.size / sizeof(uint32_t);
+                set.num_ids = 0;
+
+                char* codes = mii_strdup(cur->parents[j]), *save;
+
+                for (char* code = strtok_r(codes, " ", &save); code; code = strtok_r(NULL, " ", &save)) {
+                    off = _mii_index_pool_intern(&strings, code);
+                    _mii_index_buf_append(&parent_ids, &off, sizeof off);
+                    ++set.num_ids;
+                }
+
+                free(codes);
+                _mii_index_buf_append(&parent_sets, &set, sizeof set);
+            }
+
+            /* the PATH directories let a sync rescan only the ones which changed */
+            mii_index_module_dirs mod_dirs;
+            mod_dirs.dirs = bin_dirs.size / sizeof(mii_index_bin_dir);
+            mod_dirs.num_dirs = cur->num_dirs;
+
+            for (int j = 0; j < cur->num_dirs; ++j) {
+                mii_index_bin_dir dir;
+
+                dir.mtime_sec = cur->dirs[j].mtime.tv_sec;
+                dir.mtime_nsec = cur->dirs[j].mtime.tv_nsec;
+                dir.path = _mii_index_pool_intern(&strings, cur->dirs[j].path);
+                dir.num_bins = cur->dirs[j].num_bins;
+
+                _mii_index_buf_append(&bin_dirs, &dir, sizeof dir);
+            }
+
+            _mii_index_buf_append(&module_dirs, &mod_dirs, sizeof mod_dirs);
+
+            /* the MODULEPATH directories let a sync find the hierarchy without analyzing every module */
+            mii_index_module_uses mod_uses;
+            mod_uses.uses = uses.size / sizeof(uint32_t);
+            mod_uses.num_uses = cur->num_uses;
+
+            for (int j = 0; j < cur->num_uses; ++j) {
+                uint32_t off = _mii_index_pool_intern(&strings, cur->uses[j]);
+                _mii_index_buf_append(&uses, &off, sizeof off);
+            }
+
+            _mii_index_buf_append(&module_uses, &mod_uses, sizeof mod_uses);
+            _mii_index_buf_append(&modules, &mod, sizeof mod);
+        }
+    }
+
+    /* keep the crawled directories so the next sync can skip unchanged ones */
+    for (int i = 0; i < p->num_dirs; ++i) {
+        const mii_modtable_dir* cur = p->dirs + i;
+        mii_index_dir dir;
+
+        dir.root = _mii_index_pool_intern(&strings, cur->root);
+        dir.prefix = _mii_index_pool_intern(&strings, cur->prefix ? cur->prefix : "");
+        dir.mtime_sec = cur->mtime.tv_sec;
+        dir.mtime_nsec = cur->mtime.tv_nsec;
+        dir.ctime_sec = cur->ctime.tv_sec;
+        dir.ctime_nsec = cur->ctime.tv_nsec;
+
+        _mii_index_buf_append(&dirs, &dir, sizeof dir);
+    }
+
+    /* invert the bin lists into the command table */
+    _mii_index_build_commands(&strings, &pairs, &commands, &postings);
+
+    /* index the distinct command names for fuzzy search */
+    _mii_index_build_fuzzy(&strings, &commands, &fuzzy);
+
+    /* give every module and parent code an id */
+    _mii_index_build_names(&strings, &modules, &parent_ids, &names);
+
+    /* lay out the sections after the header */
+    mii_index_header hdr;
+    memset(&hdr, 0, sizeof hdr);
+
+    memcpy(hdr.magic, MII_INDEX_MAGIC_BYTES, sizeof hdr.magic);
+    hdr.version = MII_INDEX_VERSION;
+    hdr.num_modules = modules.size / sizeof(mii_index_module);
+
+    mii_index_buf* sections[MII_INDEX_SECTION_MAX] = {0};
+
+    sections[MII_INDEX_SECTION_STRINGS] = &strings.buf;
+    sections[MII_INDEX_SECTION_MODULES] = &modules;
+    sections[MII_INDEX_SECTION_BINS]    = &bins;
+    sections[MII_INDEX_SECTION_PARENTS] = &parents;
+    sections[MII_INDEX_SECTION_COMMANDS] = &commands;
+    sections[MII_INDEX_SECTION_POSTINGS] = &postings;
+    sections[MII_INDEX_SECTION_FUZZY]    = &fuzzy;
+    sections[MII_INDEX_SECTION_NAMES]    = &names;
+    sections[MII_INDEX_SECTION_PARENT_SETS] = &parent_sets;
+    sections[MII_INDEX_SECTION_PARENT_IDS]  = &parent_ids;
+    sections[MII_INDEX_SECTION_DIRS]        = &dirs;
+    sections[MII_INDEX_SECTION_BIN_DIRS]    = &bin_dirs;
+    sections[MII_INDEX_SECTION_MODULE_DIRS] = &module_dirs;
+    sections[MII_INDEX_SECTION_MODULE_USES] = &module_uses;
+    sections[MII_INDEX_SECTION_USES]        = &uses;
+
+    uint64_t offset = sizeof hdr;
+
+    for (int i = 0; i < MII_INDEX_SECTION_MAX; ++i) {
+        if (!sections[i]) continue;
+
+        _mii_index_buf_pad(sections[i]);
+
+        hdr.sections[i].offset = offset;
+        hdr.sections[i].size = sections[i]->size;
+        offset += sections[i]->size;
+    }
+
+    /* write everything to a temporary file first */
+    int res = 0;
+    char* tmp_path = malloc(strlen(path) + 32);
+    sprintf(tmp_path, "%s.tmp.%ld", path, (long) getpid());
+
+    FILE* f = fopen(tmp_path, "wb");
+
+    if (!f) {
+        mii_error("Couldn't open %s for writing: %s", tmp_path, strerror(errno));
+        res = -1;
+    } else {
+        fwrite(&hdr, sizeof hdr, 1, f);
+
+        for (int i = 0; i < MII_INDEX_SECTION_MAX; ++i) {
+            if (sections[i] && sections[i]->size) fwrite(sections[i]->data, 1, sections[i]->size, f);
+        }
+
+        if (ferror(f) | fclose(f)) {
+            mii_error("Couldn't write %s: %s", tmp_path, strerror(errno));
+            remove(tmp_path);
+            res = -1;
+        } else if (rename(tmp_path, path)) {
+            mii_error("Couldn't replace %s: %s", path, strerror(errno));
+            remove(tmp_path);
+            res = -1;
+        }
+    }
+
+    mii_debug("Wrote %u modules, %u unique strings to %s", hdr.num_modules, strings.num_strings, path);
+
+    free(tmp_path);
+    _mii_index_pool_free(&strings);
+    _mii_index_buf_free(&modules);
+    _mii_index_buf_free(&bins);
+    _mii_index_buf_free(&parents);
+    _mii_index_buf_free(&pairs);
+    _mii_index_buf_free(&commands);
+    _mii_index_buf_free(&postings);
+    _mii_index_buf_free(&fuzzy);
+    _mii_index_buf_free(&names);
+    _mii_index_buf_free(&parent_sets);
+    _mii_index_buf_free(&parent_ids);
+    _mii_index_buf_free(&dirs);
+    _mii_index_buf_free(&bin_dirs);
+    _mii_index_buf_free(&module_dirs);
+    _mii_index_buf_free(&uses);
+    _mii_index_buf_free(&module_uses);
+
+    return res;
+}
+
+/*
+ * build the command hashtable and its posting lists from (command, module) pairs
+ * a module providing the same command from several directories is posted once
+ */
+void _mii_index_build_commands(mii_index_pool* strings, mii_index_buf* pairs, mii_index_buf* commands, mii_index_buf* postings) {
+    mii_index_pair* p = (mii_index_pair*) pairs->data;
+    uint32_t num_pairs = pairs->size / sizeof *p, num_names = 0;
+
+    if (num_pairs) qsort(p, num_pairs, sizeof *p, _mii_index_pair_compare);
+
+    for (uint32_t i = 0; i < num_pairs; ++i) {
+        if (!i || p[i].name != p[i - 1].name) ++num_names;
+    }
+
+    /* keep the table at most half full so probes stay short */
+    uint32_t num_slots = 1;
+    while (num_slots < num_names * 2) num_slots *= 2;
+
+    mii_index_command* slots = calloc(num_slots, sizeof *slots);
+
+    for (uint32_t i = 0; i < num_pairs;) {
+        mii_index_command cmd;
+        const char* name = strings->buf.data + p[i].name;
+
+        cmd.hash = XXH32(name, strlen(name), 0);
+        cmd.name = p[i].name;
+        cmd.postings = postings->size / sizeof(uint32_t);
+        cmd.num_postings = 0;
+
+        for (uint32_t j = i; i < num_pairs && p[i].name == cmd.name; ++i) {
+            if (i > j && p[i].module == p[i - 1].module) continue;
+
+            _mii_index_buf_append(postings, &p[i].module, sizeof p[i].module);
+            ++cmd.num_postings;
+        }
+
+        uint32_t slot = cmd.hash & (num_slots - 1);
+        while (slots[slot].num_postings) slot = (slot + 1) & (num_slots - 1);
+
+        slots[slot] = cmd;
+    }
+
+    _mii_index_buf_append(commands, slots, num_slots * sizeof *slots);
+    free(slots);
+}
+
+/*
+ * build the name hashtable over every module and parent code, then replace
+ * the name offsets held by the modules and parent sets with name ids
+ */
+void _mii_index_build_names(mii_index_pool* strings, mii_index_buf* modules, mii_index_buf* parent_ids, mii_index_buf* names) {
+    mii_index_module* mods = (mii_index_module*) modules->data;
+    uint32_t* ids = (uint32_t*) parent_ids->data;
+    uint32_t num_mods = modules->size / sizeof *mods, num_ids = parent_ids->size / sizeof *ids;
+
+    /* the pool is deduplicated, so distinct offsets are distinct names */
+    uint32_t num_offsets = 0;
+    uint32_t* offsets = malloc((num_mods + num_ids + 1) * sizeof *offsets);
+
+    for (uint32_t i = 0; i < num_mods; ++i) offsets[num_offsets++] = mods[i].name_id;
+    for (uint32_t i = 0; i < num_ids; ++i) offsets[num_offsets++] = ids[i];
+
+    qsort(offsets, num_offsets, sizeof *offsets, _mii_index_offset_compare);
+
+    uint32_t num_unique = 0;
+
+    for (uint32_t i = 0; i < num_offsets; ++i) {
+        if (!i || offsets[i] != offsets[i - 1]) offsets[num_unique++] = offsets[i];
+    }
+
+    /* keep the table at most half full so probes stay short */
+    uint32_t num_slots = 1;
+    while (num_slots < num_unique * 2) num_slots *= 2;
+
+    mii_index_name* slots = calloc(num_slots, sizeof *slots);
+    uint32_t* slot_of = malloc((num_unique + 1) * sizeof *slot_of);
+
+    for (uint32_t i = 0; i < num_unique; ++i) {
+        const char* name = strings->buf.data + offsets[i];
+        uint32_t hash = XXH32(name, strlen(name), 0);
+
+        uint32_t slot = hash & (num_slots - 1);
+        while (slots[slot].name) slot = (slot + 1) & (num_slots - 1);
+
+        slots[slot].hash = hash;
+        slots[slot].name = offsets[i];
+        slot_of[i] = slot;
+    }
+
+    /* every offset is present, so the searches can't miss */
+    for (uint32_t i = 0; i < num_mods; ++i) {
+        uint32_t* found = bsearch(&mods[i].name_id, offsets, num_unique, sizeof *offsets, _mii_index_offset_compare);
+        mods[i].name_id = slot_of[found - offsets];
+    }
+
+    for (uint32_t i = 0; i < num_ids; ++i) {
+        uint32_t* found = bsearch(ids + i, offsets, num_unique, sizeof *offsets, _mii_index_offset_compare);
+        ids[i] = slot_of[found - offsets];
+    }
+
+    _mii_index_buf_append(names, slots, num_slots * sizeof *slots);
+
+    free(offsets);
+    free(slot_of);
+    free(slots);
+}
+
+/*
+ * build a BK-tree over every command in the table and flatten it
+ * breadth-first, so each node's children are contiguous and sorted
+ */
+void _mii_index_build_fuzzy(mii_index_pool* strings, mii_index_buf* commands, mii_index_buf* fuzzy) {
+    const mii_index_command* slots = (const mii_index_command*) commands->data;
+    uint32_t num_slots = commands->size / sizeof *slots, num_nodes = 0;
+
+    mii_index_bknode* tree = malloc(num_slots * sizeof *tree);
+
+    /* searches compare case-folded names, intern them before the pool is read */
+    for (uint32_t i = 0; i < num_slots; ++i) {
+        if (!slots[i].num_postings) continue;
+
+        char* folded = mii_fold_case(strings->buf.data + slots[i].name);
+
+        tree[num_nodes].command = i;
+        tree[num_nodes].name = _mii_index_pool_intern(strings, folded);
+        ++num_nodes;
+
+        free(folded);
+    }
+
+    for (uint32_t n = 0; n < num_nodes; ++n) {
+        mii_index_bknode* node = tree + n;
+        const char* name = strings->buf.data + node->name;
+
+        node->distance = node->first_child = node->next_sibling = 0;
+
+        /* descend along matching edges until the node finds its place */
+        for (uint32_t cur = 0; n;) {
+            uint32_t dist = mii_damerau_distance(name, strings->buf.data + tree[cur].name);
+            uint32_t child = tree[cur].first_child;
+
+            while (child && tree[child].distance != dist) child = tree[child].next_sibling;
+
+            if (!child) {
+                node->distance = dist;
+                node->next_sibling = tree[cur].first_child;
+                tree[cur].first_child = n;
+                break;
+            }
+
+            cur = child;
+        }
+    }
+
+    /* flatten breadth-first: nodes are emitted in queue order */
+    uint32_t* queue = malloc(num_nodes * sizeof *queue);
+    mii_index_fuzzy_node* out = calloc(num_nodes, sizeof *out);
+    uint32_t head = 0, tail = 0;
+
+    if (num_nodes) {
+        queue[tail++] = 0;
+        out[0].command = tree[0].command;
+        out[0].name = tree[0].name;
+    }
+
+    for (; head < tail; ++head) {
+        uint32_t first = tail;
+
+        /* stash each child's tree node in .children until it is dequeued */
+        for (uint32_t child = tree[queue[head]].first_child; child; child = tree[child].next_sibling) {
+            out[tail].command = tree[child].command;
+            out[tail].name = tree[child].name;
+            out[tail].distance = tree[child].distance;
+            out[tail].children = child;
+            ++tail;
+        }
+
+        /* order the children by edge distance so searches can stop early */
+        qsort(out + first, tail - first, sizeof *out, _mii_index_fuzzy_node_compare);
+
+        for (uint32_t i = first; i < tail; ++i) queue[i] = out[i].children;
+
+        out[head].children = first;
+        out[head].num_children = tail - first;
+    }
+
+    mii_debug("Built fuzzy index over %u commands", num_nodes);
+
+    _mii_index_buf_append(fuzzy, out, num_nodes * sizeof *out);
+
+    free(out);
+    free(queue);
+    free(tree);
+}
+
+int _mii_index_fuzzy_node_compare(const void* a, const void* b) {
+    const mii_index_fuzzy_node* na = a, *nb = b;
+
+    if (na->distance != nb->distance) return (na->distance < nb->distance) ? -1 : 1;
+
+    return 0;
+}
+
+int _mii_index_offset_compare(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+
+    if (x != y) return (x < y) ? -1 : 1;
+
+    return 0;
+}
+
+int _mii_index_pair_compare(const void* a, const void* b) {
+    const mii_index_pair* pa = a, *pb = b;
+
+    if (pa->name != pb->name) return (pa->name < pb->name) ? -1 : 1;
+    if (pa->module != pb->module) return (pa->module < pb->module) ? -1 : 1;
+
+    return 0;
+}
+
+/*
+ * locate a section in a mapped index
+ * returns NULL (and a zero count) if the section is absent or malformed
+ * <count> may be NULL for tables sized by another one
+ */
+const void* _mii_index_get_section(mii_index* idx, const mii_index_header* hdr, int id, size_t elem_size, uint32_t* count) {
+    const mii_index_section* sec = hdr->sections + id;
+    uint32_t unused;
+
+    if (!count) count = &unused;
+    *count = 0;
+
+    if (!sec->size) return NULL;
+
+    if (sec->offset % MII_INDEX_ALIGN || sec->offset > idx->size || sec->size > idx->size - sec->offset) {
+        return NULL;
+    }
+
+    /* sections are padded to the alignment, trailing bytes are not elements */
+    *count = sec->size / elem_size;
+
+    return (const char*) idx->base + sec->offset;
+}
+
+void _mii_index_buf_append(mii_index_buf* b, const void* data, size_t len) {
+    if (b->size + len > b->cap) {
+        while (b->size + len > b->cap) b->cap = b->cap ? b->cap * 2 : 4096;
+        b->data = realloc(b->data, b->cap);
+    }
+
+    memcpy(b->data + b->size, data, len);
+    b->size += len;
+}
+
+void _mii_index_buf_pad(mii_index_buf* b) {
+    static const char zeros[MII_INDEX_ALIGN];
+    if (b->size % MII_INDEX_ALIGN) _mii_index_buf_append(b, zeros, MII_INDEX_ALIGN - b->size % MII_INDEX_ALIGN);
+}
+
+void _mii_index_buf_free(mii_index_buf* b) {
+    free(b->data);
+    memset(b, 0, sizeof *b);
+}
+
+void _mii_index_pool_init(mii_index_pool* pool) {
+    memset(pool, 0, sizeof *pool);
+
+    pool->num_slots = 1024;
+    pool->slots = calloc(pool->num_slots, sizeof *pool->slots);
+
+    /* offset 0 is always the empty string */
+    _mii_index_pool_intern(pool, "");
+}
+
+/*
+ * add a string to the pool, returning its offset
+ * identical strings share a single copy
+ */
+uint32_t _mii_index_pool_intern(mii_index_pool* pool, const char* str) {
+    size_t len = strlen(str);
+    uint32_t mask = pool->num_slots - 1;
+    uint32_t slot = XXH32(str, len, 0) & mask;
+
+    for (; pool->slots[slot]; slot = (slot + 1) & mask) {
+        const char* cand = pool->buf.data + pool->slots[slot] - 1;
+        if (!strcmp(cand, str)) return pool->slots[slot] - 1;
+    }
+
+    uint32_t off = pool->buf.size;
+    _mii_index_buf_append(&pool->buf, str, len + 1);
+
+    pool->slots[slot] = off + 1;
+
+    /* keep the table at most half full */
+    if (++pool->num_strings * 2 > pool->num_slots) {
+        uint32_t* old_slots = pool->slots;
+        uint32_t old_num = pool->num_slots;
+
+        pool->num_slots *= 2;
+        pool->slots = calloc(pool->num_slots, sizeof *pool->slots);
+        mask = pool->num_slots - 1;
+
+        for (uint32_t i = 0; i < old_num; ++i) {
+            if (!old_slots[i]) continue;
+
+            const char* s = pool->buf.data + old_slots[i] - 1;
+            uint32_t j = XXH32(s, strlen(s), 0) & mask;
+
+            while (pool->slots[j]) j = (j + 1) & mask;
+            pool->slots[j] = old_slots[i];
+        }
+
+        free(old_slots);
+    }
+
+    return off;
+}
+
+void _mii_index_pool_free(mii_index_pool* pool) {
+    _mii_index_buf_free(&pool->buf);
+    free(pool->slots);
+    memset(pool, 0, sizeof *pool);
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+/*
+ * mii_index
+ *
+ * on-disk module index (format v2)
+ * the file is a fixed header followed by a string pool and fixed-width
+ * tables, so it can be mapped and queried in place without any parsing
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* bumped whenever the layout of a table changes */
+#define MII_INDEX_VERSION 4
+
+/* returned by mii_index_map() when the file is in the legacy 0xBEE5 format */
+#define MII_INDEX_LEGACY 1
+
+/* every section starts on this boundary so tables can be read in place */
+#define MII_INDEX_ALIGN 8
+
+/* section slots, a slot never changes meaning once assigned */
+#define MII_INDEX_SECTION_STRINGS  0 /* NUL-terminated strings, deduplicated */
+#define MII_INDEX_SECTION_MODULES  1 /* mii_index_module table */
+#define MII_INDEX_SECTION_BINS     2 /* string offsets, ranges owned by modules */
+#define MII_INDEX_SECTION_PARENTS  3 /* string offsets, ranges owned by modules */
+#define MII_INDEX_SECTION_COMMANDS 4 /* open-addressed mii_index_command hashtable */
+#define MII_INDEX_SECTION_POSTINGS 5 /* module indices, ranges owned by commands */
+#define MII_INDEX_SECTION_FUZZY    6 /* mii_index_fuzzy_node BK-tree over command names */
+#define MII_INDEX_SECTION_NAMES    7 /* open-addressed mii_index_name hashtable */
+#define MII_INDEX_SECTION_PARENT_SETS 8 /* mii_index_parent_set, one per parent table entry */
+#define MII_INDEX_SECTION_PARENT_IDS  9 /* name ids, ranges owned by parent sets */
+#define MII_INDEX_SECTION_DIRS       10 /* mii_index_dir table, optional */
+#define MII_INDEX_SECTION_BIN_DIRS   11 /* mii_index_bin_dir table, ranges owned by modules, optional */
+#define MII_INDEX_SECTION_MODULE_DIRS 12 /* mii_index_module_dirs, one per module, optional */
+#define MII_INDEX_SECTION_MODULE_USES 13 /* mii_index_module_uses, one per module, optional */
+#define MII_INDEX_SECTION_USES       14 /* string offsets, ranges owned by module uses */
+#define MII_INDEX_SECTION_MAX      16
+
+/* returned by mii_index_find_name() for names the index doesn't know */
+#define MII_INDEX_NO_NAME UINT32_MAX
+
+struct _mii_modtable;
+
+typedef struct _mii_index_section {
+    uint64_t offset, size;
+} mii_index_section;
+
+typedef struct _mii_index_header {
+    unsigned char magic[4];
+    uint32_t version, num_modules, reserved;
+    mii_index_section sections[MII_INDEX_SECTION_MAX];
+} mii_index_header;
+
+typedef struct _mii_index_module {
+    uint32_t path, code, type;
+    uint32_t sort_key;             /* mii_sort_key() of the code */
+    uint32_t name_id;              /* the code in the name table */
+    uint32_t bins, num_bins;       /* range in the bin table */
+    uint32_t parents, num_parents; /* range in the parent table */
+    uint32_t reserved;
+    int64_t timestamp;
+} mii_index_module;
+
+/* one distinct command name and the modules which provide it */
+typedef struct _mii_index_command {
+    uint32_t hash, name;
+    uint32_t postings, num_postings; /* range in the posting table, empty slots have none */
+} mii_index_command;
+
+/*
+ * one module code, of a module or a parent, its slot is the name id
+ * ids let a query mark its loaded modules once and test results by id
+ */
+typedef struct _mii_index_name {
+    uint32_t hash, name; /* empty slots have no name */
+} mii_index_name;
+
+/* the codes of one parent table entry, split on spaces */
+typedef struct _mii_index_parent_set {
+    uint32_t ids, num_ids; /* range in the parent id table */
+} mii_index_parent_set;
+
+/*
+ * one crawled module directory and its times when it was read
+ * a sync only reads directories again if their times changed
+ */
+typedef struct _mii_index_dir {
+    int64_t mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+    uint32_t root, prefix; /* prefix is relative to the root, empty for the root itself */
+} mii_index_dir;
+
+/* a PATH directory scanned for a module, its bins are the next <num_bins> of the module's */
+typedef struct _mii_index_bin_dir {
+    int64_t mtime_sec, mtime_nsec; /* mtime_sec is -1 if the directory wasn't found */
+    uint32_t path, num_bins;
+} mii_index_bin_dir;
+
+/* the PATH directories of one module, parallel to the module table */
+typedef struct _mii_index_module_dirs {
+    uint32_t dirs, num_dirs; /* range in the bin directory table */
+} mii_index_module_dirs;
+
+/* the MODULEPATH directories one module adds, parallel to the module table */
+typedef struct _mii_index_module_uses {
+    uint32_t uses, num_uses; /* range in the use table */
+} mii_index_module_uses;
+
+/*
+ * BK-tree node over the distinct command names, node 0 is the root
+ * distances are unrestricted damerau-levenshtein between case-folded names
+ */
+typedef struct _mii_index_fuzzy_node {
+    uint32_t command;  /* slot in the command table */
+    uint32_t name;     /* case-folded command name */
+    uint32_t distance; /* distance to the parent node */
+    uint32_t children, num_children; /* range in the node table, sorted by distance */
+} mii_index_fuzzy_node;
+
+/* read-only view of a mapped index */
+typedef struct _mii_index {
+    void* base;
+    size_t size;
+    uint32_t num_modules, num_bins, num_parents, strings_size;
+    const char* strings;
+    const mii_index_module* modules;
+    const uint32_t* bins, *parents;
+    uint32_t num_commands, num_postings; /* num_commands is the slot count, a power of 2 */
+    const mii_index_command* commands;
+    const uint32_t* postings;
+    uint32_t num_fuzzy_nodes;
+    const mii_index_fuzzy_node* fuzzy_nodes;
+    uint32_t num_names, num_parent_ids; /* num_names is the slot count, a power of 2 */
+    const mii_index_name* names;
+    const mii_index_parent_set* parent_sets; /* parallel to the parent table */
+    const uint32_t* parent_ids;
+    uint32_t num_dirs; /* 0 if the index was written without directory times */
+    const mii_index_dir* dirs;
+    uint32_t num_bin_dirs;
+    const mii_index_bin_dir* bin_dirs;
+    const mii_index_module_dirs* module_dirs; /* NULL if the index didn't record PATH directories */
+    uint32_t num_uses;
+    const uint32_t* uses;
+    const mii_index_module_uses* module_uses; /* NULL if the index didn't record MODULEPATH changes */
+} mii_index;
+
+/* resolve a string pool offset, the result is valid until the index is unmapped */
+#define mii_index_string(idx, off) ((idx)->strings + (off))
+
+int mii_index_map(mii_index* idx, const char* path);
+void mii_index_unmap(mii_index* idx);
+
+/* find the modules providing a command, NULL if nothing does */
+const mii_index_command* mii_index_lookup(mii_index* idx, const char* cmd);
+
+/* find the id of the first <len> bytes of <name>, MII_INDEX_NO_NAME if unknown */
+uint32_t mii_index_find_name(mii_index* idx, const char* name, size_t len);
+
+/*
+ * find every command within <max_distance> of the case-folded <query>
+ * the matching fuzzy nodes are stored in a new array in *nodes_out
+ */
+uint32_t mii_index_similar(mii_index* idx, const char* query, int max_distance, uint32_t** nodes_out);
+
+/* write the analyzed modules of a table, replacing <path> atomically */
+int mii_index_write(struct _mii_modtable* p, const char* path);
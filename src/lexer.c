@@ -0,0 +1,257 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "lexer.h"
+#include "log.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+char* _mii_lexer_next_tcl(mii_lexer* lex);
+char* _mii_lexer_next_lua(mii_lexer* lex);
+char* _mii_lexer_lua_comment(char* c);
+char* _mii_lexer_lua_string(char* c);
+char* _mii_lexer_lua_long(char* c);
+char* _mii_lexer_end(mii_lexer* lex, char* start, char* c);
+
+/* characters the Tcl scanner has to look at, everything else is part of a word */
+static const char _mii_lexer_tcl_special[256] = {
+    [0] = 1, ['\\'] = 1, ['\n'] = 1, ['"'] = 1, [';'] = 1,
+    ['{'] = 1, ['}'] = 1, ['['] = 1, [']'] = 1, [' '] = 1, ['\t'] = 1,
+};
+
+/*
+ * read a whole file into memory
+ */
+int mii_lexer_open(mii_lexer* lex, const char* path, int syntax) {
+    struct stat st;
+
+    memset(lex, 0, sizeof *lex);
+    lex->syntax = syntax;
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        mii_error("Couldn't open %s for reading : %s", path, strerror(errno));
+        return -1;
+    }
+
+    /* regular files take one read and one to see the end, the buffer grows for anything else */
+    size_t capacity = (!fstat(fd, &st) && st.st_size > 0) ? (size_t) st.st_size + 2 : 4096;
+    lex->buf = malloc(capacity);
+
+    while (1) {
+        if (lex->size + 1 == capacity) {
+            capacity *= 2;
+            lex->buf = realloc(lex->buf, capacity);
+        }
+
+        ssize_t res = read(fd, lex->buf + lex->size, capacity - lex->size - 1);
+
+        if (res < 0) {
+            if (errno == EINTR) continue;
+
+            mii_error("Couldn't read %s : %s", path, strerror(errno));
+            close(fd);
+            mii_lexer_close(lex);
+            return -1;
+        }
+
+        if (!res) break;
+        lex->size += res;
+    }
+
+    close(fd);
+
+    lex->buf[lex->size] = 0;
+    lex->cur = lex->buf;
+
+    return 0;
+}
+
+void mii_lexer_close(mii_lexer* lex) {
+    free(lex->buf);
+    memset(lex, 0, sizeof *lex);
+}
+
+char* mii_lexer_next(mii_lexer* lex) {
+    switch (lex->syntax) {
+    case MII_LEXER_TCL:
+        return _mii_lexer_next_tcl(lex);
+    case MII_LEXER_LUA:
+        return _mii_lexer_next_lua(lex);
+    }
+
+    return NULL;
+}
+
+/*
+ * a Tcl command ends at a newline or semicolon outside of quotes, braces and brackets
+ * braces are only followed within a line, so the bodies of if and foreach blocks
+ * are read as statements of their own
+ */
+char* _mii_lexer_next_tcl(mii_lexer* lex) {
+    char* c = lex->cur;
+
+    while (1) {
+        while (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n' || *c == ';' || (*c == '\\' && c[1] == '\n')) c += (*c == '\\') ? 2 : 1;
+
+        if (*c != '#') break;
+
+        /* comments run to the end of the line, a backslash continues them */
+        while (*c && *c != '\n') c += (*c == '\\' && c[1]) ? 2 : 1;
+    }
+
+    if (!*c) {
+        lex->cur = c;
+        return NULL;
+    }
+
+    char* start = c;
+    int braces = 0, brackets = 0, quoted = 0, word_start = 1;
+
+    for (; *c; ++c) {
+        if (!_mii_lexer_tcl_special[(unsigned char) *c]) {
+            while (!_mii_lexer_tcl_special[(unsigned char) c[1]]) ++c;
+            word_start = 0;
+            continue;
+        }
+
+        if (*c == '\\' && c[1]) {
+            ++c;
+            word_start = 0;
+            continue;
+        }
+
+        if (*c == '\n') {
+            if (!quoted && !brackets) break;
+            braces = 0;
+        } else if (braces) {
+            if (*c == '{') ++braces;
+            if (*c == '}') --braces;
+        } else if (*c == '"' && (quoted || word_start)) {
+            quoted = !quoted;
+        } else if (*c == '{' && word_start) {
+            braces = 1;
+        } else if (*c == '[') {
+            ++brackets;
+        } else if (*c == ']' && brackets) {
+            --brackets;
+        } else if (*c == ';' && !quoted && !brackets) {
+            break;
+        }
+
+        word_start = (*c == ' ' || *c == '\t' || *c == '[');
+    }
+
+    return _mii_lexer_end(lex, start, c);
+}
+
+/*
+ * a Lua statement ends at a newline outside of open parentheses, braces and strings
+ */
+char* _mii_lexer_next_lua(mii_lexer* lex) {
+    char* c = lex->cur;
+
+    while (1) {
+        while (isspace((unsigned char) *c) || *c == ';') ++c;
+
+        if (c[0] != '-' || c[1] != '-') break;
+        c = _mii_lexer_lua_comment(c);
+    }
+
+    if (!*c) {
+        lex->cur = c;
+        return NULL;
+    }
+
+    char* start = c, *end;
+    int depth = 0;
+
+    while (*c) {
+        if (c[0] == '-' && c[1] == '-') {
+            c = _mii_lexer_lua_comment(c);
+        } else if (*c == '"' || *c == '\'') {
+            c = _mii_lexer_lua_string(c);
+        } else if (*c == '[' && (end = _mii_lexer_lua_long(c))) {
+            c = end;
+        } else {
+            if (*c == '(' || *c == '{') {
+                ++depth;
+            } else if ((*c == ')' || *c == '}') && depth) {
+                --depth;
+            } else if (*c == '\n' || *c == '\r') {
+                if (!depth) break;
+                *c = ' ';
+            }
+
+            ++c;
+        }
+    }
+
+    return _mii_lexer_end(lex, start, c);
+}
+
+/*
+ * blank out a comment, returns the first character after it
+ */
+char* _mii_lexer_lua_comment(char* c) {
+    char* end = _mii_lexer_lua_long(c + 2);
+
+    if (!end) {
+        for (end = c; *end && *end != '\n'; ++end);
+    }
+
+    memset(c, ' ', end - c);
+    return end;
+}
+
+/*
+ * skip a quoted string, an unfinished one ends with its line
+ */
+char* _mii_lexer_lua_string(char* c) {
+    char quote = *c++;
+
+    for (; *c && *c != quote && *c != '\n'; ++c) {
+        if (*c == '\\' && c[1]) ++c;
+    }
+
+    return (*c == quote) ? c + 1 : c;
+}
+
+/*
+ * skip a long bracket like [[ ... ]] or [==[ ... ]==], NULL if <c> doesn't open one
+ */
+char* _mii_lexer_lua_long(char* c) {
+    size_t level = 0;
+
+    if (*c != '[') return NULL;
+    while (c[1 + level] == '=') ++level;
+    if (c[1 + level] != '[') return NULL;
+
+    for (c += level + 2; *c; ++c) {
+        if (*c != ']') continue;
+
+        size_t i = 0;
+        while (i < level && c[1 + i] == '=') ++i;
+
+        if (i == level && c[1 + level] == ']') return c + level + 2;
+    }
+
+    return c;
+}
+
+/*
+ * terminate a statement in place and continue after it
+ */
+char* _mii_lexer_end(mii_lexer* lex, char* start, char* c) {
+    if (*c) *c++ = 0;
+
+    lex->cur = c;
+    return start;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+/*
+ * mii_lexer
+ *
+ * splits a whole modulefile, read at once, into logical statements
+ * a statement can span several lines: Tcl continuations and quoted words,
+ * Lua calls whose parentheses or braces are still open
+ */
+
+#include <stddef.h>
+
+/* modulefile syntaxes */
+#define MII_LEXER_TCL 0
+#define MII_LEXER_LUA 1
+
+typedef struct _mii_lexer {
+    char* buf; /* the whole file, statements are terminated in place */
+    size_t size;
+    char* cur;
+    int syntax;
+} mii_lexer;
+
+int mii_lexer_open(mii_lexer* lex, const char* path, int syntax);
+void mii_lexer_close(mii_lexer* lex);
+
+/*
+ * the next statement, NULL at the end of the file
+ * Tcl statements keep their text, comments are skipped
+ * Lua comments are blanked out and line breaks inside a statement become spaces
+ */
+char* mii_lexer_next(mii_lexer* lex);
@@ -50,18 +50,6 @@ function getenv (...)
     if val then return val else return "" end
 end
 
--- The bare minimum to check for PATH modifications in modulefiles
-test_env = {
-    pathJoin        = pathJoin,
-    prepend_path    = handle_path,
-    append_path     = handle_path,
-    os              = {getenv = getenv},
-    assert          = assert,
-    error           = error,
-    ipairs          = ipairs,
-    pairs           = pairs,
-}
-
 meta_table.__index  = fake_func
 
 -- These functions may get called if the modulefile tries to use a
@@ -77,17 +65,40 @@ local meta_obj = {
 }
 
 setmetatable(fake_obj, meta_obj)
-setmetatable(test_env, meta_table)
+
+--------------------------------------------------------------------------
+-- Make the environment a module runs in, with the bare minimum to check
+-- for PATH modifications. Every module gets its own, so globals set by
+-- one module are gone when the next one runs.
+-- @param paths The table the module's PATH values are added to
+local function new_env(paths)
+    local env = {
+        pathJoin        = pathJoin,
+        prepend_path    = path_handler(paths),
+        append_path     = path_handler(paths),
+        os              = {getenv = getenv},
+        assert          = assert,
+        error           = error,
+        ipairs          = ipairs,
+        pairs           = pairs,
+    }
+
+    env.loadfile = function (filename) return loadfile(filename, env) end
+    env.dofile   = function (filename) return dofile(filename, env) end
+
+    return setmetatable(env, meta_table)
+end
 
 --------------------------------------------------------------------------
 -- Load the provided code in a sandbox environment and return it as a
 -- function. This function works with Lua 5.1.
 -- @param untrusted_code A string containing lua code
-local function loadcode5_1(untrusted_code)
+-- @param env The environment to run the code in
+local function loadcode5_1(untrusted_code, env)
     if untrusted_code:byte(1) == 27 then error("binary bytecode prohibited") end
     local untrusted_function, message = loadstring(untrusted_code)
     if not untrusted_function then error(message) end
-    setfenv(untrusted_function, test_env)
+    setfenv(untrusted_function, env)
     return untrusted_function
 end
 
@@ -95,8 +106,9 @@ end
 -- Load the provided code in a sandbox environment and return it as a
 -- function. This function works with Lua 5.2 or higher.
 -- @param untrusted_code A string containing lua code
-local function loadcode5_2(untrusted_code)
-    local untrusted_function, message = load(untrusted_code, nil, 't', test_env)
+-- @param env The environment to run the code in
+local function loadcode5_2(untrusted_code, env)
+    local untrusted_function, message = load(untrusted_code, nil, 't', env)
     if not untrusted_function then error(message) end
     return untrusted_function
 end
@@ -106,29 +118,27 @@ loadcode = (_VERSION == "Lua 5.1") and loadcode5_1 or loadcode5_2
 --------------------------------------------------------------------------
 -- Read an entire file and load it's code as a function in a sandbox env.
 -- @param filename The name/path of the file to load
-function loadfile(filename)
+-- @param env The environment to run the code in
+function loadfile(filename, env)
     local file = assert(io.open(filename, "r"))
     local code = file:read("*a")
     file:close()
-    return loadcode(code)
+    return loadcode(code, env)
 end
 
 --------------------------------------------------------------------------
 -- Execute a lua file in a sandbox environment.
 -- @param filename The name/path of the file to load
-function dofile(filename)
-    return assert(loadfile(filename))()
+-- @param env The environment to run the code in
+function dofile(filename, env)
+    return assert(loadfile(filename, env))()
 end
 
--- add the functions to the sandbox env
-test_env.loadfile = loadfile
-test_env.dofile   = dofile
-
 --------------------------------------------------------------------------
 -- Load the provided code in a sandbox environment and execute it
 -- @param untrusted_code A string containing lua code
 function sandbox_run(untrusted_code)
-    paths = {}
-    loadcode(untrusted_code)()
+    local paths = {}
+    loadcode(untrusted_code, new_env(paths))()
     return paths
 end
\ No newline at end of file
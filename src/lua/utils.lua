@@ -201,9 +201,14 @@ local function convert2table(...)
    return t
 end
 
-function handle_path(...)
-   local t = convert2table(...)
-   if t[1] == "PATH" then
-      paths[#paths+1] = t[2]
+--------------------------------------------------------------------------
+-- Make a prepend_path/append_path replacement for one module.
+-- @param paths The table the module's PATH values are added to
+function path_handler(paths)
+   return function(...)
+      local t = convert2table(...)
+      if t[1] == "PATH" then
+         paths[#paths+1] = t[2]
+      end
    end
 end
\ No newline at end of file
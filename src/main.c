@@ -17,12 +17,19 @@
 static const char* USAGE_STRING =
     "USAGE: %s [FLAGS] [OPTIONS] <SUBCOMMAND>\n\n"
     "FLAGS:\n"
+    "    -c, --client     Search through a running 'mii serve' when possible\n"
     "    -j, --json       Output results in JSON encoding\n"
     "    -h, --help       Show this message\n"
     "    -v, --version    Show Mii build version\n"
     "\nOPTIONS:\n"
     "    -d, --datadir <datadir>    Use <datadir> to store index data\n"
     "    -m, --modulepath <path>    Use <path> instead of $MODULEPATH\n"
+    "    -s, --socket <path>        Use <path> as the 'mii serve' socket\n"
+    "    -t, --threads <count>      Index modules with <count> threads (default: one per cpu)\n"
+#if MII_ENABLE_LUA
+    "    -I, --lua-instructions <n> Stop sandboxed modules after <n> Lua instructions (default: 10000000)\n"
+    "    -M, --lua-memory <MiB>     Stop sandboxed modules using more than <MiB> of memory (default: 64)\n"
+#endif
     "\nSUBCOMMANDS:\n"
     "    build               Regenerate the module index\n"
     "    sync                Update the module index\n"
@@ -30,6 +37,7 @@ static const char* USAGE_STRING =
     "    search <command>    Search for commands similar to <command>\n"
     "    show <module>       Show commands provided by <module>\n"
     "    list                List all cached module files\n"
+    "    serve               Answer searches from a resident index\n"
     "    install             Install mii into your shell\n"
     "    enable              Enable mii integration (default)\n"
     "    disable             Disable mii integration\n"
@@ -40,12 +48,26 @@ static const char* USAGE_STRING =
 static struct option long_options[] = {
     { "datadir",    required_argument, NULL, 'd' },
     { "modulepath", required_argument, NULL, 'm' },
+    { "socket",     required_argument, NULL, 's' },
+    { "threads",    required_argument, NULL, 't' },
+#if MII_ENABLE_LUA
+    { "lua-instructions", required_argument, NULL, 'I' },
+    { "lua-memory", required_argument, NULL, 'M' },
+#endif
+    { "client",     no_argument,       NULL, 'c' },
     { "help",       no_argument,       NULL, 'h' },
     { "json",       no_argument,       NULL, 'j' },
     { "version",    no_argument,       NULL, 'v' },
     { NULL,         0,                 NULL,  0 },
 };
 
+/* the sandbox budget only exists with Lua */
+#if MII_ENABLE_LUA
+#define MII_LUA_OPTSTRING "I:M:"
+#else
+#define MII_LUA_OPTSTRING ""
+#endif
+
 static void usage(int header, char* a0);
 static int install();
 static void version();
@@ -54,7 +76,7 @@ int main(int argc, char** argv) {
     int opt;
     int search_result_flags = 0;
 
-    while ((opt = getopt_long(argc, argv, "d:m:hjv", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "d:m:s:t:" MII_LUA_OPTSTRING "chjv", long_options, NULL)) != -1) {
         switch (opt) {
         case 'd': /* set datadir */
             mii_option_datadir(optarg);
@@ -62,6 +84,23 @@ int main(int argc, char** argv) {
         case 'm': /* set modulepath */
             mii_option_modulepath(optarg);
             break;
+        case 's': /* set daemon socket */
+            mii_option_socket(optarg);
+            break;
+        case 't': /* set indexing thread count */
+            mii_option_threads(strtol(optarg, NULL, 10));
+            break;
+#if MII_ENABLE_LUA
+        case 'I': /* set sandbox budget */
+            mii_option_lua_instructions(strtol(optarg, NULL, 10));
+            break;
+        case 'M':
+            mii_option_lua_memory(strtol(optarg, NULL, 10));
+            break;
+#endif
+        case 'c':
+            mii_option_client(1);
+            break;
         case 'j':
             search_result_flags |= MII_SEARCH_RESULT_JSON;
             break;
@@ -114,7 +153,7 @@ int main(int argc, char** argv) {
 
         /* perform the search */
         mii_search_result res;
-        if (mii_search_fuzzy(&res, argv[optind])) return -1;
+        if (mii_search_fuzzy(&res, argv[optind], MII_SEARCH_RESULT_FUZZY_MAX, MII_SEARCH_RESULT_LIMIT_RESULTS)) return -1;
 
         /* output the result and clean up */
         mii_search_result_write(&res, stdout, MII_SEARCH_RESULT_MODE_FUZZY, search_result_flags);
@@ -224,11 +263,11 @@ int main(int argc, char** argv) {
         } else {
             /* no results. we need to perform a fuzzy search now */
             mii_search_result_free(&res);
-            if (mii_search_fuzzy(&res, cmd)) return -1;
+            if (mii_search_fuzzy(&res, cmd, maximum, MII_SEARCH_RESULT_LIMIT_BINS)) return -1;
 
             /* output the best 'maximum' values */
             if (res.num_results) {
-                if (res.distances[0] == 0 || res.num_results == 1) {
+                if (res.distances[0] == 0 || res.num_matches == 1) {
                     /* user made a case mistake. recommend the right command */
                     if (select_colors) fprintf(stderr, "\033[0;39m");
                     fprintf(stderr, "[mii] Did you mean ");
@@ -242,7 +281,7 @@ int main(int argc, char** argv) {
                     fprintf(stderr, "\n");
                 } else {
                     /* no near-matches, so we can just recommened some almost similar (and unique) ones */
-                    char** bins = NULL;
+                    const char** bins = NULL;
                     mii_search_result_get_unique_bins(&res, &bins, &maximum);
                     if (select_colors) fprintf(stderr, "\033[0;39m");
                     fprintf(stderr, "[mii] ");
@@ -274,6 +313,8 @@ int main(int argc, char** argv) {
         mii_search_result_free(&res);
     } else if (!strcmp(argv[optind], "list")) {
         if (mii_list()) return -1;
+    } else if (!strcmp(argv[optind], "serve")) {
+        if (mii_serve()) return -1;
     } else if (!strcmp(argv[optind], "help")) {
         usage(1, *argv);
     } else if (!strcmp(argv[optind], "install")) {
@@ -4,22 +4,49 @@
 #include "util.h"
 #include "log.h"
 #include "analysis.h"
+#include "serve.h"
 
 #include <errno.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <libgen.h>
 
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 /* options */
 static char* _mii_modulepath = NULL;
 static char* _mii_datadir    = NULL;
+static char* _mii_socket     = NULL;
+static int   _mii_client     = 0;
+static int   _mii_threads    = 0;
+static int   _mii_lua_instructions = MII_ANALYSIS_LUA_INSTRUCTIONS;
+static int   _mii_lua_memory       = MII_ANALYSIS_LUA_MEMORY;
 
 /* state */
 static char* _mii_datafile = NULL;
 
+/* the index searched by this process, results point into it until mii_free() */
+static mii_modtable _mii_search_table;
+static int _mii_search_table_loaded = 0;
+
+/* daemon state, the last index file seen and the id of the one served */
+static struct stat _mii_serve_stat;
+static char _mii_serve_index[MII_SERVE_INDEX_ID_SIZE];
+static volatile sig_atomic_t _mii_serve_stop = 0;
+
+/* import the index, building or migrating it first if needed */
+int _mii_import(mii_modtable* index);
+mii_modtable* _mii_search_index();
+int _mii_search_remote(const char* op, const char* query, int limit, int limit_mode, mii_search_result* res);
+
+/* daemon helpers */
+void _mii_serve_answer(int fd);
+void _mii_serve_reload();
+void _mii_serve_signal(int sig);
+
 void mii_option_modulepath(const char* modulepath) {
     if (modulepath) _mii_modulepath = mii_strdup(modulepath);
 }
@@ -28,6 +55,26 @@ void mii_option_datadir(const char* datadir) {
     if (datadir) _mii_datadir = mii_strdup(datadir);
 }
 
+void mii_option_socket(const char* socket) {
+    if (socket) _mii_socket = mii_strdup(socket);
+}
+
+void mii_option_client(int client) {
+    _mii_client = client;
+}
+
+void mii_option_threads(int threads) {
+    _mii_threads = threads;
+}
+
+void mii_option_lua_instructions(int instructions) {
+    _mii_lua_instructions = instructions;
+}
+
+void mii_option_lua_memory(int memory) {
+    _mii_lua_memory = memory;
+}
+
 int mii_init() {
     if (!_mii_modulepath) {
         char* env_modulepath = getenv("MODULEPATH");
@@ -86,14 +133,24 @@ int mii_init() {
         _mii_datafile = mii_join_path(_mii_datadir, "index");
     }
 
+    if (!_mii_socket) _mii_socket = mii_serve_default_socket(_mii_datadir);
+
+    /* module trees are mostly network bound, so one thread per cpu is a floor rather than a limit */
+    if (_mii_threads <= 0) _mii_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (_mii_threads <= 0) _mii_threads = 1;
+
+    mii_analysis_lua_budget(_mii_lua_instructions, _mii_lua_memory);
+
     mii_debug("Initialized mii with cache path %s", _mii_datafile);
     return 0;
 }
 
 void mii_free() {
+    if (_mii_search_table_loaded) mii_modtable_free(&_mii_search_table);
     if (_mii_modulepath) free(_mii_modulepath);
     if (_mii_datadir) free(_mii_datadir);
     if (_mii_datafile) free(_mii_datafile);
+    if (_mii_socket) free(_mii_socket);
 }
 
 int mii_build() {
@@ -107,29 +164,32 @@ int mii_build() {
     int count;
 
 #if MII_ENABLE_SPIDER
-    if (mii_modtable_spider_gen(&index, _mii_modulepath, &count)) {
+    if (mii_modtable_spider_gen(&index, _mii_modulepath, NULL, &count)) {
         mii_error("Unexpected failure generating the index with spider!");
         return -1;
     }
 #else
-    /* initialize analysis regular expressions */
-    if (mii_analysis_init()) {
-        mii_error("Unexpected failure initializing analysis functions!");
-        return -1;
-    }
-
     /* generate a partial index from the disk */
-    if (mii_modtable_gen(&index, _mii_modulepath)) {
+    if (mii_modtable_gen(&index, _mii_modulepath, _mii_threads, NULL)) {
         mii_error("Error occurred during index generation, terminating!");
         return -1;
     }
 
     /* perform analysis over the entire index */
-    if (mii_modtable_analysis(&index, &count)) {
+    if (mii_modtable_analysis(&index, _mii_threads, &count)) {
         mii_error("Error occurred during index analysis, terminating!");
         return -1;
     }
 
+    /* follow the MODULEPATH directories added by modules */
+    int hierarchy_count;
+
+    if (mii_modtable_hierarchy(&index, _mii_threads, NULL, &hierarchy_count)) {
+        mii_error("Error occurred during hierarchy discovery, terminating!");
+        return -1;
+    }
+
+    count += hierarchy_count;
 #endif
 
     if (count) {
@@ -147,10 +207,6 @@ int mii_build() {
     /* cleanup */
     mii_modtable_free(&index);
 
-#if !MII_ENABLE_SPIDER
-    mii_analysis_free();
-#endif
-
     return 0;
 }
 
@@ -161,15 +217,17 @@ int mii_sync() {
 
     mii_modtable index;
     mii_modtable_init(&index);
+    int count;
 
-    /* initialize analysis regular expressions */
-    if (mii_analysis_init()) {
-        mii_error("Unexpected failure initializing analysis functions!");
+#if MII_ENABLE_SPIDER
+    /* spider lists every modulefile, only the ones which changed since the last sync are scanned */
+    if (mii_modtable_spider_gen(&index, _mii_modulepath, _mii_datafile, &count)) {
+        mii_error("Unexpected failure generating the index with spider!");
         return -1;
     }
-
-    /* generate a partial index from the disk */
-    if (mii_modtable_gen(&index, _mii_modulepath)) {
+#else
+    /* generate a partial index from the disk, reading only directories which changed since the last sync */
+    if (mii_modtable_gen(&index, _mii_modulepath, _mii_threads, _mii_datafile)) {
         mii_error("Error occurred during index generation, terminating!");
         return -1;
     }
@@ -180,16 +238,24 @@ int mii_sync() {
     }
 
     /* perform analysis over any remaining modules */
-    int count;
-
-    if (mii_modtable_analysis(&index, &count)) {
+    if (mii_modtable_analysis(&index, _mii_threads, &count)) {
         mii_error("Error occurred during index analysis, terminating!");
         return -1;
     }
 
+    /* follow the MODULEPATH directories added by modules, reusing their modules the same way */
+    int hierarchy_count;
 
-    /* export back to the disk only if modules were analyzed */
-    if (count) {
+    if (mii_modtable_hierarchy(&index, _mii_threads, _mii_datafile, &hierarchy_count)) {
+        mii_error("Error occurred during hierarchy discovery, terminating!");
+        return -1;
+    }
+
+    count += hierarchy_count;
+#endif
+
+    /* export back to the disk only if modules were analyzed, directories changed or the format changed */
+    if (count || index.dirs_changed || index.legacy_import) {
         mii_info("Finished analysis on %d modules", count);
 
         if (mii_modtable_export(&index, _mii_datafile)) {
@@ -202,151 +268,277 @@ int mii_sync() {
 
     /* cleanup */
     mii_modtable_free(&index);
-    mii_analysis_free();
 
     return 0;
 }
 
 int mii_search_exact(mii_search_result* res, const char* cmd) {
-    mii_modtable index;
-    mii_modtable_init(&index);
+    if (!_mii_search_remote(MII_SERVE_OP_EXACT, cmd, 0, 0, res)) return 0;
 
-    /* try and import the cache from the disk */
-    if (mii_modtable_import(&index, _mii_datafile)) {
-        mii_warn("Couldn't import module index, will try and build one now.");
+    mii_modtable* index = _mii_search_index();
+    if (!index) return -1;
 
-        if (mii_build()) return -1;
+    /* perform the search */
+    if (mii_modtable_search_exact(index, cmd, getenv("LOADEDMODULES"), res)) {
+        mii_error("Error occurred during search, terminating!");
+        return -1;
+    }
+
+    return 0;
+}
 
-        mii_info("Trying to import new index..");
+int mii_search_fuzzy(mii_search_result* res, const char* cmd, int limit, int limit_mode) {
+    if (!_mii_search_remote(MII_SERVE_OP_SEARCH, cmd, limit, limit_mode, res)) return 0;
 
-        if (mii_modtable_import(&index, _mii_datafile)) {
-            mii_error("Failed to import again, giving up..");
-            return -1;
-        }
-    }
+    mii_modtable* index = _mii_search_index();
+    if (!index) return -1;
 
     /* perform the search */
-    if (mii_modtable_search_exact(&index, cmd, res)) {
+    if (mii_modtable_search_similar(index, cmd, limit, limit_mode, getenv("LOADEDMODULES"), res)) {
         mii_error("Error occurred during search, terminating!");
         return -1;
     }
 
-    /* cleanup */
-    mii_modtable_free(&index);
+    return 0;
+}
+
+int mii_search_info(mii_search_result* res, const char* cmd) {
+    if (!_mii_search_remote(MII_SERVE_OP_SHOW, cmd, 0, 0, res)) return 0;
+
+    mii_modtable* index = _mii_search_index();
+    if (!index) return -1;
+
+    /* perform the search */
+    if (mii_modtable_search_info(index, cmd, res)) {
+        mii_error("Error occurred during search, terminating!");
+        return -1;
+    }
 
     return 0;
 }
 
-int mii_search_fuzzy(mii_search_result* res, const char* cmd) {
+int mii_list() {
     mii_modtable index;
     mii_modtable_init(&index);
 
     /* try and import the cache from the disk */
-    if (mii_modtable_import(&index, _mii_datafile)) {
-        mii_warn("Couldn't import module index, will try and build one now.");
+    if (_mii_import(&index)) return -1;
 
-        if (mii_build()) return -1;
+    int should_color = isatty(fileno(stdout));
+    int code_width;
 
-        mii_info("Trying to import new index..");
+    mii_index* idx = &index.map;
 
-        if (mii_modtable_import(&index, _mii_datafile)) {
-            mii_error("Failed to import again, giving up..");
-            return -1;
+    /* compute code column width if we're pretty printing */
+    if (should_color) {
+        code_width = 0;
+
+        for (uint32_t i = 0; i < idx->num_modules; ++i) {
+            int len = strlen(mii_index_string(idx, idx->modules[i].code));
+            if (len > code_width) code_width = len;
         }
+
+        printf("\033[0;39mIndexed modules (total %u):\n", idx->num_modules);
     }
 
-    /* perform the search */
-    if (mii_modtable_search_similar(&index, cmd, res)) {
-        mii_error("Error occurred during search, terminating!");
-        return -1;
+    for (uint32_t i = 0; i < idx->num_modules; ++i) {
+        const char* code = mii_index_string(idx, idx->modules[i].code);
+
+        if (should_color) {
+            printf("    \033[0;39m%-*s    \033[2;37m%s\n", code_width, code, mii_index_string(idx, idx->modules[i].path));
+        } else {
+            printf("%s\n", code);
+        }
     }
 
-    /* cleanup */
-    mii_modtable_free(&index);
+    if (should_color) printf("\033[0;39m");
 
+    mii_modtable_free(&index);
     return 0;
 }
 
-int mii_search_info(mii_search_result* res, const char* cmd) {
-    mii_modtable index;
-    mii_modtable_init(&index);
+mii_modtable* _mii_search_index() {
+    /* import the cache from the disk once, later searches reuse the mapping */
+    if (!_mii_search_table_loaded) {
+        mii_modtable_init(&_mii_search_table);
 
-    /* try and import the cache from the disk */
-    if (mii_modtable_import(&index, _mii_datafile)) {
-        mii_warn("Couldn't import module index, will try and build one now.");
+        if (_mii_import(&_mii_search_table)) {
+            mii_modtable_free(&_mii_search_table);
+            return NULL;
+        }
 
-        if (mii_build()) return -1;
+        _mii_search_table_loaded = 1;
+    }
 
-        mii_info("Trying to import new index..");
+    return &_mii_search_table;
+}
 
-        if (mii_modtable_import(&index, _mii_datafile)) {
-            mii_error("Failed to import again, giving up..");
-            return -1;
-        }
+/*
+ * ask a running daemon to search, in client mode only
+ * any failure leaves the search to this process
+ */
+int _mii_search_remote(const char* op, const char* query, int limit, int limit_mode, mii_search_result* res) {
+    if (!_mii_client) return -1;
+
+    /* the daemon must serve this very file, a missing index is built locally */
+    struct stat st;
+    char index[MII_SERVE_INDEX_ID_SIZE];
+
+    if (stat(_mii_datafile, &st)) return -1;
+    mii_serve_index_id(&st, index);
+
+    return mii_serve_query(_mii_socket, index, op, query, limit, limit_mode, getenv("LOADEDMODULES"), res);
+}
+
+int _mii_import(mii_modtable* index) {
+    int res = mii_modtable_import(index, _mii_datafile);
+
+    if (!res) return 0;
+
+    if (res == MII_INDEX_LEGACY) {
+        /* a sync reuses every analyzed module from the legacy index */
+        mii_info("Migrating the module index to the current format..");
+
+        if (mii_sync()) return -1;
+    } else {
+        mii_warn("Couldn't import module index, will try and build one now.");
+
+        if (mii_build()) return -1;
     }
 
-    /* perform the search */
-    if (mii_modtable_search_info(&index, cmd, res)) {
-        mii_error("Error occurred during search, terminating!");
+    mii_info("Trying to import new index..");
+
+    if (mii_modtable_import(index, _mii_datafile)) {
+        mii_error("Failed to import again, giving up..");
         return -1;
     }
 
-    /* cleanup */
-    mii_modtable_free(&index);
-
     return 0;
 }
 
-int mii_list() {
-    mii_modtable index;
-    mii_modtable_init(&index);
+int mii_serve() {
+    /*
+     * SERVE: keep the index mapped and answer searches over a socket
+     */
 
-    /* try and import the cache from the disk */
-    if (mii_modtable_import(&index, _mii_datafile)) {
-        mii_warn("Couldn't import module index, will try and build one now.");
+    struct sigaction action;
+    int fd;
 
-        if (mii_build()) return -1;
+    /* stat first, an index replaced while importing is picked up by the next request */
+    if (stat(_mii_datafile, &_mii_serve_stat)) memset(&_mii_serve_stat, 0, sizeof _mii_serve_stat);
+    if (!_mii_search_index()) return -1;
 
-        mii_info("Trying to import new index..");
+    /* building the index replaced the file */
+    if (!_mii_serve_stat.st_ino) stat(_mii_datafile, &_mii_serve_stat);
+    mii_serve_index_id(&_mii_serve_stat, _mii_serve_index);
 
-        if (mii_modtable_import(&index, _mii_datafile)) {
-            mii_error("Failed to import again, giving up..");
-            return -1;
+    if ((fd = mii_serve_listen(_mii_socket)) < 0) return -1;
+
+    /* no SA_RESTART, so a signal interrupts accept() and ends the loop */
+    memset(&action, 0, sizeof action);
+    action.sa_handler = _mii_serve_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    mii_info("Serving %s on %s", _mii_datafile, _mii_socket);
+
+    while (!_mii_serve_stop) {
+        int client = accept(fd, NULL, NULL);
+
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+
+            mii_error("Couldn't accept a client: %s", strerror(errno));
+            break;
         }
+
+        _mii_serve_answer(client);
+        close(client);
     }
 
-    int should_color = isatty(fileno(stdout));
-    int code_width, count = 0;
+    close(fd);
+    unlink(_mii_socket);
 
-    /* compute code column width if we're pretty printing */
-    if (should_color) {
-        code_width = 0;
+    mii_info("Stopped serving queries.");
+    return _mii_serve_stop ? 0 : -1;
+}
 
-        for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
-            for (mii_modtable_entry* cur = index.buf[i]; cur; cur = cur->next) {
-                int len = strlen(cur->code);
-                if (len > code_width) code_width = len;
-                ++count;
-            }
-        }
+/*
+ * answer one request, clients search locally whenever this fails
+ */
+void _mii_serve_answer(int fd) {
+    mii_serve_request req;
+    mii_search_result res;
+    int err;
+
+    if (mii_serve_read_request(fd, &req)) return;
+
+    /* reload first, the client may have seen a newer index. clients choose theirs with -d or MII_INDEX_FILE */
+    _mii_serve_reload();
 
-        printf("\033[0;39mIndexed modules (total %d):\n", count);
+    if (strcmp(req.index, _mii_serve_index)) {
+        mii_serve_write_error(fd, "serving another index");
+        mii_serve_request_free(&req);
+        return;
     }
 
-    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
-        for (mii_modtable_entry* cur = index.buf[i]; cur; cur = cur->next) {
-            if (should_color) {
-                printf("    \033[0;39m%-*s    \033[2;37m%s\n", code_width, cur->code, cur->path);
-            } else {
-                printf("%s\n", cur->code);
-            }
-        }
+    if (!strcmp(req.op, MII_SERVE_OP_EXACT)) {
+        err = mii_modtable_search_exact(&_mii_search_table, req.query, req.loaded_modules, &res);
+    } else if (!strcmp(req.op, MII_SERVE_OP_SEARCH)) {
+        err = mii_modtable_search_similar(&_mii_search_table, req.query, req.limit, req.limit_mode, req.loaded_modules, &res);
+    } else if (!strcmp(req.op, MII_SERVE_OP_SHOW)) {
+        err = mii_modtable_search_info(&_mii_search_table, req.query, &res);
+    } else {
+        mii_serve_write_error(fd, "unknown operation");
+        mii_serve_request_free(&req);
+        return;
     }
 
-    if (should_color) printf("\033[0;39m");
+    if (err) {
+        mii_serve_write_error(fd, "search failed");
+    } else {
+        mii_serve_write_result(fd, &res);
+        mii_search_result_free(&res);
+    }
 
-    mii_modtable_free(&index);
-    return 0;
+    mii_serve_request_free(&req);
+}
+
+/*
+ * map the index again if a build or sync replaced it
+ * the previous mapping is kept until the new one imports cleanly
+ */
+void _mii_serve_reload() {
+    struct stat st;
+
+    /* a missing index keeps the last one until a sync writes it again */
+    if (stat(_mii_datafile, &st)) return;
+
+    if (st.st_dev == _mii_serve_stat.st_dev && st.st_ino == _mii_serve_stat.st_ino &&
+        st.st_mtime == _mii_serve_stat.st_mtime && st.st_size == _mii_serve_stat.st_size) return;
+
+    /* only try each version of the file once */
+    _mii_serve_stat = st;
+
+    mii_modtable fresh;
+    mii_modtable_init(&fresh);
+
+    if (mii_modtable_import(&fresh, _mii_datafile)) {
+        mii_modtable_free(&fresh);
+        mii_warn("Couldn't reload the module index, still serving the previous one.");
+        return;
+    }
+
+    mii_modtable_free(&_mii_search_table);
+    _mii_search_table = fresh;
+    mii_serve_index_id(&st, _mii_serve_index);
+
+    mii_info("Reloaded the module index.");
+}
+
+void _mii_serve_signal(int sig) {
+    _mii_serve_stop = 1;
 }
 
 int mii_enable() {
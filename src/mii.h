@@ -14,6 +14,11 @@
 
 void mii_option_modulepath(const char* modulepath);
 void mii_option_datadir(const char* datadir);
+void mii_option_socket(const char* socket);
+void mii_option_client(int client); /* truthy to search through a running daemon when possible */
+void mii_option_threads(int threads); /* threads crawling and analyzing modules, <= 0 uses one per cpu */
+void mii_option_lua_instructions(int instructions); /* Lua instructions each sandboxed module may run, <= 0 for no limit */
+void mii_option_lua_memory(int memory); /* MiB each sandboxed module may allocate, <= 0 for no limit */
 
 int mii_init();
 void mii_free();
@@ -28,10 +33,14 @@ int mii_sync();
 int mii_list();
 
 /* search operations output a JSON result to stdout */
+/* results point into the searched index and stay valid until mii_free() */
 int mii_search_exact(mii_search_result* res, const char* cmd);
-int mii_search_fuzzy(mii_search_result* res, const char* cmd);
+int mii_search_fuzzy(mii_search_result* res, const char* cmd, int limit, int limit_mode); /* keeps the best <limit> results */
 int mii_search_info(mii_search_result* res, const char* code);
 
+/* keep the index resident and answer searches over a unix socket until interrupted */
+int mii_serve();
+
 /* status operations */
 int mii_enable();
 int mii_disable();
@@ -9,33 +9,139 @@
 
 #if MII_ENABLE_SPIDER
 #include "cjson/cJSON.h"
-#include <unistd.h>
 #endif
 
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
-/* should never really need to change. identify the mii_modtable file format */
+/* identify the legacy mii_modtable file format, superseded by the v2 index */
 static const unsigned char MII_MODTABLE_MAGIC_BYTES[] = { 0xBE, 0xE5 };
 
-int _mii_modtable_parse_from(mii_modtable* p, const char* path, int (*handler)(mii_modtable* p, char* path, char* code, char** bins, int num_bins, char** parents, int num_parents, time_t timestamp));
+typedef int (*mii_modtable_parse_handler)(mii_modtable* p, char* path, char* code, char** bins, int num_bins, char** parents, int num_parents, mii_modtable_bin_dir* dirs, int num_dirs, char** uses, int num_uses, time_t timestamp);
+
+int _mii_modtable_parse_from(mii_modtable* p, const char* path, mii_modtable_parse_handler handler);
+int _mii_modtable_parse_mapped(mii_modtable* p, mii_index* idx, mii_modtable_parse_handler handler);
+int _mii_modtable_parse_legacy(mii_modtable* p, const char* path, mii_modtable_parse_handler handler);
 int _mii_modtable_get_target_index(const char* path);
 mii_modtable_entry* _mii_modtable_locate_entry(mii_modtable* p, const char* path);
 
 /* parse handlers */
-int _mii_modtable_parse_handler_import(mii_modtable* p, char* path, char* code, char** bins, int num_bins, char** parents, int num_parents, time_t timestamp);
-int _mii_modtable_parse_handler_preanalysis(mii_modtable* p, char* path, char* code, char** bins, int num_bins, char** parents, int num_parents, time_t timestamp);
+int _mii_modtable_parse_handler_preanalysis(mii_modtable* p, char* path, char* code, char** bins, int num_bins, char** parents, int num_parents, mii_modtable_bin_dir* dirs, int num_dirs, char** uses, int num_uses, time_t timestamp);
+void _mii_modtable_free_dirs(mii_modtable_bin_dir* dirs, int num_dirs);
+void _mii_modtable_free_entry(mii_modtable_entry* mod);
+
+/* search helpers */
+unsigned char* _mii_modtable_loaded(mii_index* idx, const char* loaded_modules);
+int _mii_modtable_priority(const unsigned char* loaded, mii_index* idx, const mii_index_module* mod, const mii_index_parent_set* set);
+void _mii_modtable_add_result(mii_index* idx, const unsigned char* loaded, const mii_index_module* mod, const char* bin, int distance, mii_search_result* res);
+
+/* mii_modtable generation, directories are crawled by threads which steal work from each other */
+typedef struct _mii_modtable_crawl_task {
+    const char* root; /* one of the table's roots */
+    char* prefix;     /* path relative to the root, NULL for the root itself */
+    const mii_index_dir* prev; /* the directory in the previous index, NULL if it must be read */
+} mii_modtable_crawl_task;
+
+typedef struct _mii_modtable_crawl_worker {
+    pthread_t thread;
+    pthread_mutex_t lock; /* guards the deque */
+    mii_modtable_crawl_task* tasks;
+    int head, tail, capacity;
+    int id;
+    struct _mii_modtable_crawl* crawl;
+} mii_modtable_crawl_worker;
+
+/* a directory or module of the previous index, sorted by root and directory so a crawl can find them */
+typedef struct _mii_modtable_prev_key {
+    const char* root, *prefix; /* not terminated for modules, the lengths count */
+    size_t root_len, prefix_len;
+    uint32_t id; /* row in the previous index */
+} mii_modtable_prev_key;
+
+typedef struct _mii_modtable_crawl {
+    mii_modtable* table;
+    int first_root; /* the table's roots from here on are crawled */
+    mii_modtable_crawl_worker* workers;
+    int num_workers;
+    pthread_mutex_t lock; /* guards the counters, table insertion and directory records */
+    pthread_cond_t work;
+    int queued, pending; /* tasks waiting in a deque, tasks not finished yet */
+    mii_index prev; /* previous index, only mapped if it recorded its directories */
+    mii_modtable_prev_key* prev_dirs, *prev_modules;
+    uint32_t num_prev_dirs, num_prev_modules;
+} mii_modtable_crawl;
+
+void* _mii_modtable_crawl_worker_run(void* arg);
+int _mii_modtable_crawl_take(mii_modtable_crawl_worker* w, mii_modtable_crawl_task* task);
+int _mii_modtable_crawl_pop(mii_modtable_crawl_worker* w, mii_modtable_crawl_task* task, int steal);
+void _mii_modtable_crawl_push(mii_modtable_crawl_worker* w, const char* root, char* prefix, const mii_index_dir* prev);
+void _mii_modtable_crawl_insert(mii_modtable_crawl* c, mii_modtable_entry* mod);
+void _mii_modtable_crawl_record(mii_modtable_crawl* c, const char* root, const char* prefix, const struct stat* st, int read);
+void _mii_modtable_crawl_dir(mii_modtable_crawl_worker* w, const char* root, const char* prefix, const mii_index_dir* prev);
+int _mii_modtable_crawl_roots(mii_modtable* p, int first_root, int threads, const char* prev_path);
+int _mii_modtable_crawl_root(mii_modtable_crawl* c, const char* root);
+
+/* reuse of directories which didn't change since the previous index */
+int _mii_modtable_crawl_prev_init(mii_modtable_crawl* c, const char* prev_path);
+void _mii_modtable_crawl_prev_free(mii_modtable_crawl* c);
+void _mii_modtable_crawl_carry(mii_modtable_crawl* c, const char* root, const char* prefix);
+int _mii_modtable_crawl_recorded(mii_modtable_crawl* c, const char* root, const char* prefix);
+int _mii_modtable_prev_compare(const void* a, const void* b);
+uint32_t _mii_modtable_prev_find(const mii_modtable_prev_key* keys, uint32_t count, const mii_modtable_prev_key* key);
+
+/* module analysis, threads take the next module from a shared list */
+typedef struct _mii_modtable_analysis_pool {
+    mii_modtable_entry** entries; /* modules to analyze, and analyzed modules to refresh */
+    int num_entries, next;
+    int num_ready, count; /* workers with an analysis state, modules analyzed or patched */
+    int tiers[MII_ANALYSIS_NUM_TIERS]; /* modules analyzed by each tier, for the build report */
+    pthread_mutex_t lock;
+    mii_analysis_cache cache; /* PATH directories scanned by any worker */
+} mii_modtable_analysis_pool;
+
+void* _mii_modtable_analysis_worker_run(void* arg);
+int _mii_modtable_analysis_run(mii_modtable* p, int threads, int first_root, int* num);
+
+/* module hierarchies, a root added by modules is reached through the parent chains of each of them */
+typedef struct _mii_modtable_root_chains {
+    char** chains; /* parent codes from the top, separated by spaces */
+    int num_chains;
+    int state; /* 0 before, 1 while and 2 after the chains are collected */
+    mii_modtable_entry** users; /* modules adding the root */
+    int num_users;
+} mii_modtable_root_chains;
+
+void _mii_modtable_add_root(mii_modtable* p, char* root);
+int _mii_modtable_find_root(mii_modtable* p, const char* root);
+void _mii_modtable_parents(mii_modtable* p);
+void _mii_modtable_root_chains_collect(mii_modtable* p, mii_modtable_root_chains* roots, int root);
 
-/* mii_modtable generation */
-int _mii_modtable_gen_recursive(mii_modtable* p, const char* root);
-int _mii_modtable_gen_recursive_sub(mii_modtable* p, const char* root, const char* prefix);
+#if MII_ENABLE_SPIDER
+/* spider-json is read a modulefile at a time, the whole output is never in memory */
+typedef struct _mii_modtable_spider_reader {
+    char* record; /* the modulefile being read */
+    size_t len, capacity;
+    int depth, in_string, escape, in_record;
+    int closed; /* the top-level object ended */
+    int count; /* modules scanned or patched */
+} mii_modtable_spider_reader;
+
+int _mii_modtable_spider_feed(mii_modtable* p, mii_modtable_spider_reader* r, mii_analysis_state* s, const char* data, size_t len);
+int _mii_modtable_spider_record(mii_modtable* p, mii_modtable_spider_reader* r, mii_analysis_state* s);
+void _mii_modtable_spider_append(mii_modtable_spider_reader* r, const char* data, size_t len);
+int _mii_modtable_spider_drop_stale(mii_modtable* p);
+int _mii_modtable_parse_handler_spider(mii_modtable* p, char* path, char* code, char** bins, int num_bins, char** parents, int num_parents, mii_modtable_bin_dir* dirs, int num_dirs, char** uses, int num_uses, time_t timestamp);
+#endif
 
 /* initialize an empty mii_modtable */
 void mii_modtable_init(mii_modtable* out) {
@@ -51,26 +157,26 @@ void mii_modtable_free(mii_modtable* p) {
 
     if (p->modulepath) free(p->modulepath);
 
-    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
-        mii_modtable_entry* cur = p->buf[i];
+    for (int i = p->num_base_roots; i < p->num_roots; ++i) {
+        free(p->roots[i]);
+    }
 
-        while (cur) {
-            free(cur->code);
-            free(cur->path);
+    free(p->roots);
 
-            for (int j = 0; j < cur->num_bins; ++j) {
-                free(cur->bins[j]);
-            }
+    mii_index_unmap(&p->map);
 
-            for (int j = 0; j < cur->num_parents; ++j) {
-                free(cur->parents[j]);
-            }
+    for (int i = 0; i < p->num_dirs; ++i) {
+        free(p->dirs[i].prefix);
+    }
 
-            free(cur->bins);
-            if (cur->num_parents > 0) free(cur->parents);
-            tmp = cur->next;
+    free(p->dirs);
+
+    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
+        mii_modtable_entry* cur = p->buf[i];
 
-            free(cur);
+        while (cur) {
+            tmp = cur->next;
+            _mii_modtable_free_entry(cur);
             cur = tmp;
         }
     }
@@ -78,11 +184,38 @@ void mii_modtable_free(mii_modtable* p) {
     memset(p, 0, sizeof *p);
 }
 
+void _mii_modtable_free_entry(mii_modtable_entry* mod) {
+    free(mod->code);
+    free(mod->path);
+
+    for (int j = 0; j < mod->num_bins; ++j) {
+        free(mod->bins[j]);
+    }
+
+    for (int j = 0; j < mod->num_parents; ++j) {
+        free(mod->parents[j]);
+    }
+
+    for (int j = 0; j < mod->num_uses; ++j) {
+        free(mod->uses[j]);
+    }
+
+    free(mod->bins);
+    if (mod->num_parents > 0) free(mod->parents);
+    free(mod->uses);
+    _mii_modtable_free_dirs(mod->dirs, mod->num_dirs);
+
+    free(mod);
+}
+
 /*
  * fill a mii_modtable with modules from the disk
  * will fail if the mii_modtable is not empty
+ *
+ * if the index at <prev_path> recorded its directories, each of them is
+ * only stat()ed and its modules are carried over unless its times changed
  */
-int mii_modtable_gen(mii_modtable* p, char* modulepath) {
+int mii_modtable_gen(mii_modtable* p, char* modulepath, int threads, const char* prev_path) {
     if (p->num_modules) {
         mii_error("Table already has modules present. Will not generate over it!\n");
         return -1;
@@ -95,12 +228,18 @@ int mii_modtable_gen(mii_modtable* p, char* modulepath) {
 
     p->modulepath = mii_strdup(modulepath);
 
-    /* split modulepath into roots, recursively crawl each */
+    /* split modulepath into roots, modules may add more later */
     for (char* root = strtok(p->modulepath, ":"); root; root = strtok(NULL, ":")) {
-        _mii_modtable_gen_recursive(p, root);
+        /* spelled like the paths modules use, so a module using a base root finds it */
+        size_t len = strlen(root);
+        while (len > 1 && root[len - 1] == '/') root[--len] = 0;
+
+        if (_mii_modtable_find_root(p, root) < 0) _mii_modtable_add_root(p, root);
     }
 
-    mii_debug("Found %d modules", p->num_modules);
+    p->num_base_roots = p->num_roots;
+
+    if (_mii_modtable_crawl_roots(p, 0, threads, prev_path)) return -1;
 
     /* after gen, every module requires analysis */
     p->modules_requiring_analysis = p->num_modules;
@@ -108,14 +247,117 @@ int mii_modtable_gen(mii_modtable* p, char* modulepath) {
     return 0;
 }
 
+/*
+ * crawl the table's roots from <first_root> on, reusing unchanged directories of the index at <prev_path>
+ */
+int _mii_modtable_crawl_roots(mii_modtable* p, int first_root, int threads, const char* prev_path) {
+    if (threads < 1) threads = 1;
+
+    mii_modtable_crawl c;
+
+    memset(&c, 0, sizeof c);
+    c.table = p;
+    c.first_root = first_root;
+    c.num_workers = threads;
+    c.workers = calloc(threads, sizeof *c.workers);
+
+    pthread_mutex_init(&c.lock, NULL);
+    pthread_cond_init(&c.work, NULL);
+
+    for (int i = 0; i < threads; ++i) {
+        c.workers[i].crawl = &c;
+        c.workers[i].id = i;
+        pthread_mutex_init(&c.workers[i].lock, NULL);
+    }
+
+    _mii_modtable_crawl_prev_init(&c, prev_path);
+
+    /* spread the roots over the workers to start */
+    int num_tasks = 0;
+
+    for (int r = first_root; r < p->num_roots; ++r) {
+        const char* root = p->roots[r];
+        mii_modtable_prev_key key = { root, "", strlen(root), 0, 0 };
+        uint32_t i = _mii_modtable_prev_find(c.prev_dirs, c.num_prev_dirs, &key);
+
+        /* new roots are crawled */
+        if (i == c.num_prev_dirs || _mii_modtable_prev_compare(c.prev_dirs + i, &key)) {
+            _mii_modtable_crawl_push(c.workers + num_tasks++ % threads, root, NULL, NULL);
+            continue;
+        }
+
+        /* known roots are checked directory by directory, the root sorts first */
+        for (; i < c.num_prev_dirs && c.prev_dirs[i].root_len == key.root_len && !memcmp(c.prev_dirs[i].root, root, key.root_len); ++i) {
+            const mii_modtable_prev_key* dir = c.prev_dirs + i;
+            char* prefix = dir->prefix_len ? mii_strdup(dir->prefix) : NULL;
+
+            _mii_modtable_crawl_push(c.workers + num_tasks++ % threads, root, prefix, c.prev.dirs + dir->id);
+        }
+    }
+
+    /* this thread is the first worker, tasks of workers which fail to start are stolen */
+    int* started = calloc(threads, sizeof *started);
+
+    for (int i = 1; i < threads; ++i) {
+        started[i] = !pthread_create(&c.workers[i].thread, NULL, _mii_modtable_crawl_worker_run, c.workers + i);
+        if (!started[i]) mii_warn("Couldn't start crawl thread %d, continuing with fewer", i);
+    }
+
+    _mii_modtable_crawl_worker_run(c.workers);
+
+    for (int i = 1; i < threads; ++i) {
+        if (started[i]) pthread_join(c.workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < threads; ++i) {
+        pthread_mutex_destroy(&c.workers[i].lock);
+        free(c.workers[i].tasks);
+    }
+
+    /* directories which went away don't show up as reads, the hierarchy counts them once every root was crawled */
+    p->num_prev_dirs = c.num_prev_dirs;
+
+    _mii_modtable_crawl_prev_free(&c);
+    pthread_mutex_destroy(&c.lock);
+    pthread_cond_destroy(&c.work);
+    free(c.workers);
+    free(started);
+
+    mii_debug("Found %d modules in %d directories using %d threads", p->num_modules, p->num_dirs, threads);
+
+    return 0;
+}
+
+/*
+ * index of a root being crawled, roots are compared by address
+ */
+int _mii_modtable_crawl_root(mii_modtable_crawl* c, const char* root) {
+    for (int i = c->first_root; i < c->table->num_roots; ++i) {
+        if (c->table->roots[i] == root) return i;
+    }
+
+    return -1;
+}
+
 /*
  * import a mii_modtable from the disk
+ * the index is mapped and searched in place, nothing is copied
  */
 int mii_modtable_import(mii_modtable* p, const char* path) {
+    int res = mii_index_map(&p->map, path);
+
+    if (res == MII_INDEX_LEGACY) {
+        mii_warn("%s is in the legacy index format and must be migrated", path);
+        return res;
+    }
+
+    if (res) return res;
+
     /* consider imported cache to be current */
+    p->num_modules = p->map.num_modules;
     p->analysis_complete = 1;
 
-    return _mii_modtable_parse_from(p, path, _mii_modtable_parse_handler_import);
+    return 0;
 }
 
 /*
@@ -133,37 +375,83 @@ int mii_modtable_preanalysis(mii_modtable* p, const char* path) {
  *
  * number of modules analyzed saved in *num if non-NULL
  */
-int mii_modtable_analysis(mii_modtable* p, int* num) {
-    mii_modtable_entry* cur;
-    int count = 0;
+int mii_modtable_analysis(mii_modtable* p, int threads, int* num) {
+    return _mii_modtable_analysis_run(p, threads, -1, num);
+}
+
+/*
+ * analyze the modules found in the table's roots from <first_root> on, -1 for every module
+ */
+int _mii_modtable_analysis_run(mii_modtable* p, int threads, int first_root, int* num) {
+    mii_modtable_analysis_pool pool;
+
+    memset(&pool, 0, sizeof pool);
+
+    /*
+     * collect the modules needing analysis so workers can hand them out by index
+     * analyzed modules which know their PATH directories are checked for changed directories
+     */
+    if (p->num_modules) pool.entries = malloc(p->num_modules * sizeof *pool.entries);
+
+    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
+        for (mii_modtable_entry* cur = p->buf[i]; cur; cur = cur->next) {
+            if (cur->root < first_root) continue;
+            if (!cur->analysis_complete || cur->num_dirs) pool.entries[pool.num_entries++] = cur;
+        }
+    }
+
+    if (!pool.num_entries) {
+        free(pool.entries);
 
-    if (!p->modules_requiring_analysis) {
         p->analysis_complete = 1;
         if (num) *num = 0;
         return 0;
     }
 
-    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
-        cur = p->buf[i];
+    pthread_mutex_init(&pool.lock, NULL);
+    mii_analysis_cache_init(&pool.cache);
 
-        while (cur) {
-            if (!cur->analysis_complete) {
-                /* need to perform analysis on this module */
+    if (threads > pool.num_entries) threads = pool.num_entries;
+    if (threads < 1) threads = 1;
 
-                if (!mii_analysis_run(cur->path, cur->type, &cur->bins, &cur->num_bins)) {
-                    mii_debug("analysis for %s : %d bins", cur->path, cur->num_bins);
+    /* this thread is the first worker */
+    pthread_t* workers = malloc(threads * sizeof *workers);
+    int* started = calloc(threads, sizeof *started);
 
-                    cur->num_parents = 0;
-                    cur->analysis_complete = 1;
-                    ++count;
-                }
-            }
+    for (int i = 1; i < threads; ++i) {
+        started[i] = !pthread_create(workers + i, NULL, _mii_modtable_analysis_worker_run, &pool);
+        if (!started[i]) mii_warn("Couldn't start analysis thread %d, continuing with fewer", i);
+    }
 
-            cur = cur->next;
-        }
+    _mii_modtable_analysis_worker_run(&pool);
+
+    for (int i = 1; i < threads; ++i) {
+        if (started[i]) pthread_join(workers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool.lock);
+    mii_analysis_cache_free(&pool.cache);
+    free(pool.entries);
+    free(workers);
+    free(started);
+
+    if (!pool.num_ready) {
+        mii_error("Unexpected failure initializing analysis functions!");
+        return -1;
+    }
+
+    int analyzed = 0;
+    for (int i = 0; i < MII_ANALYSIS_NUM_TIERS; ++i) analyzed += pool.tiers[i];
+
+    if (analyzed) {
+        mii_info("Analyzed %d modules statically, %d in the Lua sandbox, %d with unresolved PATH changes, %d over the sandbox budget",
+                 pool.tiers[MII_ANALYSIS_TIER_STATIC],
+                 pool.tiers[MII_ANALYSIS_TIER_SANDBOX],
+                 pool.tiers[MII_ANALYSIS_TIER_UNRESOLVED],
+                 pool.tiers[MII_ANALYSIS_TIER_TIMEOUT]);
     }
 
-    if (num) *num = count;
+    if (num) *num = pool.count;
 
     p->modules_requiring_analysis = 0;
     p->analysis_complete = 1;
@@ -172,110 +460,252 @@ int mii_modtable_analysis(mii_modtable* p, int* num) {
 }
 
 /*
- * export a mii_modtable to disk
+ * analyze modules from the pool until none are left
+ * every worker has its own analysis state, so modules are analyzed independently
  */
-int mii_modtable_export(mii_modtable* p, const char* path) {
-    FILE* f = fopen(path, "wb");
+void* _mii_modtable_analysis_worker_run(void* arg) {
+    mii_modtable_analysis_pool* pool = arg;
+    mii_analysis_state state;
+    int count = 0;
 
-    if (!f) {
-        mii_error("Couldn't open %s for writing: %s\n", path, strerror(errno));
-        return -1;
-    }
+    if (mii_analysis_init(&state, &pool->cache)) return NULL;
 
-    mii_debug("Exporting %d modules to %s", p->num_modules, path);
+    pthread_mutex_lock(&pool->lock);
+    ++pool->num_ready;
+    pthread_mutex_unlock(&pool->lock);
 
-    /* write magic sequence */
-    fwrite(MII_MODTABLE_MAGIC_BYTES, sizeof MII_MODTABLE_MAGIC_BYTES, 1, f);
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        int next = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
 
-    /* write number of expected modules */
-    fwrite(&p->num_modules, sizeof p->num_modules, 1, f);
+        if (next >= pool->num_entries) break;
 
-    /* write each module entry */
-    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
-        mii_modtable_entry* cur = p->buf[i];
+        mii_modtable_entry* cur = pool->entries[next];
 
-        while(cur) {
-            /* don't write modules that analysis failed for */
-            if (!cur->analysis_complete) {
-                cur = cur->next;
-                continue;
+        /* an up-to-date module only needs the PATH directories which changed scanned again */
+        if (cur->analysis_complete) {
+            if (mii_analysis_refresh(&state, cur)) {
+                mii_debug("refreshed %s : %d bins", cur->path, cur->num_bins);
+                ++count;
             }
 
-            /* write path size and data */
-            int path_len = strlen(cur->path);
-            fwrite(&path_len, sizeof path_len, 1, f);
-            fwrite(cur->path, 1, path_len, f);
+            continue;
+        }
+
+        if (!mii_analysis_run(&state, cur)) {
+            mii_debug("analysis for %s : %d bins", cur->path, cur->num_bins);
 
-            /* write code size and data */
-            int code_len = strlen(cur->code);
-            fwrite(&code_len, sizeof code_len, 1, f);
-            fwrite(cur->code, 1, code_len, f);
+            cur->num_parents = 0;
+            cur->analysis_complete = 1;
+            ++count;
+        }
+    }
 
-            /* write timestamp */
-            fwrite(&cur->timestamp, sizeof cur->timestamp, 1, f);
+    mii_analysis_free(&state);
 
-            /* write number of bins */
-            fwrite(&cur->num_bins, sizeof cur->num_bins, 1, f);
+    pthread_mutex_lock(&pool->lock);
+    pool->count += count;
 
-            /* write each bin length and data */
-            for (int j = 0; j < cur->num_bins; ++j) {
-                int bin_len = strlen(cur->bins[j]);
-                fwrite(&bin_len, sizeof bin_len, 1, f);
-                fwrite(cur->bins[j], 1, bin_len, f);
-            }
+    for (int i = 0; i < MII_ANALYSIS_NUM_TIERS; ++i) pool->tiers[i] += state.tiers[i];
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/*
+ * crawl the MODULEPATH directories modules add, a round at a time since their modules can add more
+ */
+int mii_modtable_hierarchy(mii_modtable* p, int threads, const char* prev_path, int* num) {
+    int total = 0;
+
+    while (1) {
+        int first_root = p->num_roots;
 
-            /* write number of parents */
-            fwrite(&cur->num_parents, sizeof cur->num_parents, 1, f);
+        for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
+            for (mii_modtable_entry* cur = p->buf[i]; cur; cur = cur->next) {
+                if (!cur->analysis_complete) continue;
 
-            /* write parent codes size and data (if any) */
-            for (int j = 0; j < cur->num_parents; ++j) {
-                int parent_len = strlen(cur->parents[j]);
-                fwrite(&parent_len, sizeof parent_len, 1, f);
-                fwrite(cur->parents[j], 1, parent_len, f);
+                for (int j = 0; j < cur->num_uses; ++j) {
+                    if (_mii_modtable_find_root(p, cur->uses[j]) < 0) _mii_modtable_add_root(p, mii_strdup(cur->uses[j]));
+                }
             }
+        }
+
+        if (p->num_roots == first_root) break;
+
+        mii_debug("Crawling %d MODULEPATH directories added by modules", p->num_roots - first_root);
 
-            cur = cur->next;
+        if (_mii_modtable_crawl_roots(p, first_root, threads, prev_path)) return -1;
+
+        /* modules in the new roots are reused like the ones found by gen */
+        if (prev_path && _mii_modtable_parse_from(p, prev_path, _mii_modtable_parse_handler_preanalysis)) {
+            mii_warn("Error occurred during index preanalysis, will analyze the new modules");
         }
+
+        int count;
+
+        if (_mii_modtable_analysis_run(p, threads, first_root, &count)) return -1;
+        total += count;
     }
 
-    /* all done. close the fd */
-    fclose(f);
+    _mii_modtable_parents(p);
+
+    if (p->num_prev_dirs && (uint32_t) p->num_dirs != p->num_prev_dirs) p->dirs_changed = 1;
+    if (num) *num = total;
+
     return 0;
 }
 
 /*
- * search for exact bin matches
+ * append a root to the table, roots past the base ones are owned by the table
  */
-int mii_modtable_search_exact(mii_modtable* p, const char* cmd, mii_search_result* res) {
-    if (!p->analysis_complete) return -1;
+void _mii_modtable_add_root(mii_modtable* p, char* root) {
+    if (p->num_roots == p->roots_capacity) {
+        p->roots_capacity = p->roots_capacity ? p->roots_capacity * 2 : 16;
+        p->roots = realloc(p->roots, p->roots_capacity * sizeof *p->roots);
+    }
 
-    mii_search_result_init(res, cmd);
+    p->roots[p->num_roots++] = root;
+}
 
-    mii_debug("Searching for bin \"%s\"..", cmd);
+int _mii_modtable_find_root(mii_modtable* p, const char* root) {
+    for (int i = 0; i < p->num_roots; ++i) {
+        if (!strcmp(p->roots[i], root)) return i;
+    }
+
+    return -1;
+}
+
+/*
+ * replace the parents of every crawled module with the chains of modules leading to its root
+ * modules in the base roots can be loaded without any
+ */
+void _mii_modtable_parents(mii_modtable* p) {
+    mii_modtable_root_chains* roots = calloc(p->num_roots ? p->num_roots : 1, sizeof *roots);
 
-    /* walk through the table and search for exact matches */
     for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
-        mii_modtable_entry* cur = p->buf[i];
+        for (mii_modtable_entry* cur = p->buf[i]; cur; cur = cur->next) {
+            if (!cur->analysis_complete || cur->root < 0) continue;
 
-        while (cur) {
-            for (int j = 0; j < cur->num_bins; ++j) {
-                if (!strcmp(cur->bins[j], cmd)) {
-                    /* show different parents as different results */
-                    for (int k = 0; k < cur->num_parents; ++k) {
-                        mii_search_result_add(res, cur->code, cmd, 0, cur->parents[k]);
-                    }
-
-                    /* if no parents, send null */
-                    if (cur->num_parents == 0) {
-                        mii_search_result_add(res, cur->code, cmd, 0, NULL);
-                    }
-                }
+            for (int j = 0; j < cur->num_uses; ++j) {
+                int root = _mii_modtable_find_root(p, cur->uses[j]);
+                if (root < p->num_base_roots) continue;
+
+                mii_modtable_root_chains* r = roots + root;
+
+                r->users = realloc(r->users, (r->num_users + 1) * sizeof *r->users);
+                r->users[r->num_users++] = cur;
             }
+        }
+    }
+
+    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
+        for (mii_modtable_entry* cur = p->buf[i]; cur; cur = cur->next) {
+            if (cur->root < 0) continue;
+
+            for (int j = 0; j < cur->num_parents; ++j) free(cur->parents[j]);
+            free(cur->parents);
+
+            cur->parents = NULL;
+            cur->num_parents = 0;
+
+            if (cur->root < p->num_base_roots) continue;
+
+            mii_modtable_root_chains* r = roots + cur->root;
+            _mii_modtable_root_chains_collect(p, roots, cur->root);
+
+            if (!r->num_chains) continue;
+
+            cur->parents = malloc(r->num_chains * sizeof *cur->parents);
+            cur->num_parents = r->num_chains;
+
+            for (int j = 0; j < r->num_chains; ++j) cur->parents[j] = mii_strdup(r->chains[j]);
+        }
+    }
+
+    for (int i = 0; i < p->num_roots; ++i) {
+        for (int j = 0; j < roots[i].num_chains; ++j) free(roots[i].chains[j]);
+
+        free(roots[i].chains);
+        free(roots[i].users);
+    }
+
+    free(roots);
+}
+
+/*
+ * collect the parent chains of a root, a chain of a user's root followed by the user
+ * roots which are only reached through themselves have no chains
+ */
+void _mii_modtable_root_chains_collect(mii_modtable* p, mii_modtable_root_chains* roots, int root) {
+    mii_modtable_root_chains* r = roots + root;
+
+    if (r->state) return;
+    r->state = 1;
+
+    for (int i = 0; i < r->num_users; ++i) {
+        mii_modtable_entry* user = r->users[i];
+        mii_modtable_root_chains* from = roots + user->root;
+
+        if (user->root < p->num_base_roots) {
+            /* the user can be loaded directly */
+            r->chains = realloc(r->chains, (r->num_chains + 1) * sizeof *r->chains);
+            r->chains[r->num_chains++] = mii_strdup(user->code);
+            continue;
+        }
+
+        _mii_modtable_root_chains_collect(p, roots, user->root);
+
+        /* a root still being collected leads back here */
+        if (from->state != 2 || !from->num_chains) continue;
+
+        r->chains = realloc(r->chains, (r->num_chains + from->num_chains) * sizeof *r->chains);
+
+        for (int j = 0; j < from->num_chains; ++j) {
+            char* chain = malloc(strlen(from->chains[j]) + strlen(user->code) + 2);
+
+            sprintf(chain, "%s %s", from->chains[j], user->code);
+            r->chains[r->num_chains++] = chain;
+        }
+    }
+
+    r->state = 2;
+}
 
-            cur = cur->next;
+/*
+ * export a mii_modtable to disk
+ */
+int mii_modtable_export(mii_modtable* p, const char* path) {
+    mii_debug("Exporting %d modules to %s", p->num_modules, path);
+
+    return mii_index_write(p, path);
+}
+
+/*
+ * search for exact bin matches
+ */
+int mii_modtable_search_exact(mii_modtable* p, const char* cmd, const char* loaded_modules, mii_search_result* res) {
+    if (!p->analysis_complete || !p->map.base) return -1;
+
+    mii_index* idx = &p->map;
+
+    mii_search_result_init(res, cmd);
+
+    mii_debug("Searching for bin \"%s\"..", cmd);
+
+    /* a single probe of the command table finds every providing module */
+    const mii_index_command* match = mii_index_lookup(idx, cmd);
+    unsigned char* loaded = _mii_modtable_loaded(idx, loaded_modules);
+
+    if (match) {
+        for (uint32_t i = 0; i < match->num_postings; ++i) {
+            _mii_modtable_add_result(idx, loaded, idx->modules + idx->postings[match->postings + i], cmd, 0, res);
         }
     }
 
+    free(loaded);
+
     mii_search_result_sort(res);
 
     return 0;
@@ -284,38 +714,48 @@ int mii_modtable_search_exact(mii_modtable* p, const char* cmd, mii_search_resul
 /*
  * search for similar bin matches
  */
-int mii_modtable_search_similar(mii_modtable* p, const char* cmd, mii_search_result* res) {
-    if (!p->analysis_complete) return -1;
+int mii_modtable_search_similar(mii_modtable* p, const char* cmd, int limit, int limit_mode, const char* loaded_modules, mii_search_result* res) {
+    if (!p->analysis_complete || !p->map.base) return -1;
 
-    mii_search_result_init(res, cmd);
+    mii_index* idx = &p->map;
+
+    mii_search_result_init_limited(res, cmd, limit, limit_mode);
 
     mii_debug("Searching for bins similar to \"%s\"..", cmd);
 
-    /* walk through the table and search for exact matches */
-    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
-        mii_modtable_entry* cur = p->buf[i];
+    /* only commands the fuzzy index can't rule out are scored */
+    char* folded = mii_fold_case(cmd);
+    uint32_t* matches;
+    uint32_t num_matches = mii_index_similar(idx, folded, MII_MODTABLE_DISTANCE_THRESHOLD - 1, &matches);
 
-        while (cur) {
-            for (int j = 0; j < cur->num_bins; ++j) {
-                int dist = mii_levenshtein_distance(cmd, cur->bins[j]); 
-
-                if (dist < MII_MODTABLE_DISTANCE_THRESHOLD) {
-                    /* show different parents as different results */
-                    for (int k = 0; k < cur->num_parents; ++k) {
-                        mii_search_result_add(res, cur->code, cur->bins[j], dist, cur->parents[k]);
-                    }
-
-                    /* if no parents, send null */
-                    if (cur->num_parents == 0) {
-                        mii_search_result_add(res, cur->code, cur->bins[j], dist, NULL);
-                    }
-                }
-            }
+    /* the index matched on the unrestricted distance, which is never larger, so rescore the candidates in one batch */
+    const char** names = malloc(num_matches * sizeof *names);
+    int* distances = malloc(num_matches * sizeof *distances);
+
+    for (uint32_t i = 0; i < num_matches; ++i) names[i] = mii_index_string(idx, idx->fuzzy_nodes[matches[i]].name);
+
+    mii_levenshtein_distance_batch(folded, names, num_matches, distances);
+
+    unsigned char* loaded = _mii_modtable_loaded(idx, loaded_modules);
+
+    for (uint32_t i = 0; i < num_matches; ++i) {
+        const mii_index_command* match = idx->commands + idx->fuzzy_nodes[matches[i]].command;
+        const char* bin = mii_index_string(idx, match->name);
+        int dist = distances[i];
+
+        if (dist >= MII_MODTABLE_DISTANCE_THRESHOLD) continue;
 
-            cur = cur->next;
+        for (uint32_t j = 0; j < match->num_postings; ++j) {
+            _mii_modtable_add_result(idx, loaded, idx->modules + idx->postings[match->postings + j], bin, dist, res);
         }
     }
 
+    free(folded);
+    free(matches);
+    free(names);
+    free(distances);
+    free(loaded);
+
     mii_search_result_sort(res);
 
     return 0;
@@ -325,25 +765,22 @@ int mii_modtable_search_similar(mii_modtable* p, const char* cmd, mii_search_res
  * search for all commands provided by a module
  */
 int mii_modtable_search_info(mii_modtable* p, const char* code, mii_search_result* res) {
-    if (!p->analysis_complete) return -1;
+    if (!p->analysis_complete || !p->map.base) return -1;
 
-    mii_search_result_init(res, code);
+    mii_index* idx = &p->map;
 
-    /* walk through the table and search for exact matches */
-    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
-        mii_modtable_entry* cur = p->buf[i];
+    mii_search_result_init(res, code);
 
-        while (cur) {
-            if (!strcmp(cur->code, code)) {
-                for (int j = 0; j < cur->num_bins; ++j) {
-                    /* parent modules are not important here */
-                    mii_search_result_add(res, cur->code, cur->bins[j], 0, NULL);
-                }
+    for (uint32_t i = 0; i < idx->num_modules; ++i) {
+        const mii_index_module* mod = idx->modules + i;
 
-                break;
+        if (!strcmp(mii_index_string(idx, mod->code), code)) {
+            for (uint32_t j = 0; j < mod->num_bins; ++j) {
+                /* parent modules and priorities are not important here */
+                mii_search_result_add(res, code, mii_index_string(idx, mod->sort_key), mii_index_string(idx, idx->bins[mod->bins + j]), 0, NULL, 0);
             }
 
-            cur = cur->next;
+            break;
         }
     }
 
@@ -351,40 +788,108 @@ int mii_modtable_search_info(mii_modtable* p, const char* code, mii_search_resul
 }
 
 /*
- * recursively walk a root and add modules to the hashtable
+ * add a search result for a mapped module
+ * modules with several parent sets produce one result per set
  */
-int _mii_modtable_gen_recursive(mii_modtable* p, const char* root) {
-    return _mii_modtable_gen_recursive_sub(p, root, NULL);
+void _mii_modtable_add_result(mii_index* idx, const unsigned char* loaded, const mii_index_module* mod, const char* bin, int distance, mii_search_result* res) {
+    const char* code = mii_index_string(idx, mod->code);
+    const char* sort_key = mii_index_string(idx, mod->sort_key);
+
+    for (uint32_t k = 0; k < mod->num_parents; ++k) {
+        mii_search_result_add(res, code, sort_key, bin, distance, mii_index_string(idx, idx->parents[mod->parents + k]),
+                              _mii_modtable_priority(loaded, idx, mod, idx->parent_sets + mod->parents + k));
+    }
+
+    /* if no parents, send null */
+    if (mod->num_parents == 0) {
+        mii_search_result_add(res, code, sort_key, bin, distance, NULL, _mii_modtable_priority(loaded, idx, mod, NULL));
+    }
 }
 
 /*
- * subroutine for _mii_modtable_gen_recursive which allows for recursively
- * computing the module relative paths (and the loading codes)
+ * mark the modules of a LOADEDMODULES list in a bitmap over the index name ids
+ * the list is parsed once per query rather than once per result
  */
-int _mii_modtable_gen_recursive_sub(mii_modtable* p, const char* root, const char* prefix) {
+unsigned char* _mii_modtable_loaded(mii_index* idx, const char* loaded_modules) {
+    unsigned char* loaded = calloc(idx->num_names / 8 + 1, 1);
+    const char* cur = loaded_modules;
+
+    if (!cur) return loaded;
+
+    while (*cur) {
+        size_t len = strcspn(cur, ":");
+
+        /* modules the index doesn't know can't match any result */
+        uint32_t id = len ? mii_index_find_name(idx, cur, len) : MII_INDEX_NO_NAME;
+        if (id != MII_INDEX_NO_NAME) loaded[id / 8] |= 1 << (id % 8);
+
+        cur += len;
+        if (*cur) ++cur;
+    }
+
+    return loaded;
+}
+
+/*
+ * rank a result: loaded modules first, then by the number of loaded parents
+ * modules without any parents come before those with unloaded parents
+ */
+int _mii_modtable_priority(const unsigned char* loaded, mii_index* idx, const mii_index_module* mod, const mii_index_parent_set* set) {
+    if (loaded[mod->name_id / 8] & (1 << (mod->name_id % 8))) return MII_SEARCH_RESULT_PRIORITY_LOADED_MOD;
+    if (!set) return MII_SEARCH_RESULT_PRIORITY_NO_PARENT;
+
+    int priority = 0;
+
+    for (uint32_t i = 0; i < set->num_ids; ++i) {
+        uint32_t id = idx->parent_ids[set->ids + i];
+        if (loaded[id / 8] & (1 << (id % 8))) priority += MII_SEARCH_RESULT_PRIORITY_LOADED_PARENT;
+    }
+
+    return priority;
+}
+
+/*
+ * crawl one directory, queueing its subdirectories and inserting its modules
+ * a directory of the previous index with the same times keeps its modules without being read
+ */
+void _mii_modtable_crawl_dir(mii_modtable_crawl_worker* w, const char* root, const char* prefix, const mii_index_dir* prev) {
+    mii_modtable_crawl* c = w->crawl;
     char* dir_path = mii_join_path(root, prefix);
-    DIR* d = opendir(dir_path);
 
     struct dirent* dp;
     struct stat st;
 
-    int result = 0;
+    if (prev && !stat(dir_path, &st) && S_ISDIR(st.st_mode) &&
+        prev->mtime_sec == st.st_mtim.tv_sec && prev->mtime_nsec == st.st_mtim.tv_nsec &&
+        prev->ctime_sec == st.st_ctim.tv_sec && prev->ctime_nsec == st.st_ctim.tv_nsec) {
+        _mii_modtable_crawl_carry(c, root, prefix);
+        _mii_modtable_crawl_record(c, root, prefix, &st, 0);
+
+        free(dir_path);
+        return;
+    }
+
+    DIR* d = opendir(dir_path);
 
     if (!d) {
         free(dir_path);
-        return -1;
+        return;
     }
 
+    /* entries are resolved relative to the open directory rather than walking the whole path again */
+    int dfd = dirfd(d);
+
+    /* the times are taken before reading, so a change while reading is seen by the next sync */
+    if (!fstat(dfd, &st)) _mii_modtable_crawl_record(c, root, prefix, &st, 1);
+
     while ((dp = readdir(d))) {
         if (dp->d_name[0] == '.') continue;
 
-        /* compute the absolute file path */
-        char* abs_path = mii_join_path(dir_path, dp->d_name);
+        /* directories are crawled without a stat when readdir() says what they are, modules need their mtime */
+        st.st_mode = mii_dirent_mode(dp);
 
-        /* stat the type */
-        if (stat(abs_path, &st)) {
-            mii_warn("Couldn't stat %s: %s", abs_path, strerror(errno));
-            free(abs_path);
+        if (!S_ISDIR(st.st_mode) && fstatat(dfd, dp->d_name, &st, 0)) {
+            mii_warn("Couldn't stat %s/%s: %s", dir_path, dp->d_name, strerror(errno));
             continue;
         }
 
@@ -392,6 +897,9 @@ int _mii_modtable_gen_recursive_sub(mii_modtable* p, const char* root, const cha
 
         /* check for normal files (likely modules) */
         if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
+            /* compute the absolute file path */
+            char* abs_path = mii_join_path(dir_path, dp->d_name);
+
             /* parse the relative path to get the module type and code */
             int rel_len = strlen(rel_path);
             int mod_type = MII_MODTABLE_MODTYPE_TCL; /* assume tcl unless we detect lmod */
@@ -413,36 +921,325 @@ int _mii_modtable_gen_recursive_sub(mii_modtable* p, const char* root, const cha
             new_module->timestamp = st.st_mtime;
             new_module->bins = NULL;
             new_module->num_bins = 0;
+            new_module->parents = NULL;
+            new_module->num_parents = 0;
+            new_module->dirs = NULL;
+            new_module->num_dirs = 0;
+            new_module->uses = NULL;
+            new_module->num_uses = 0;
+            new_module->root = _mii_modtable_crawl_root(c, root);
             new_module->analysis_complete = 0;
 
-            int target_index = _mii_modtable_get_target_index(abs_path);
-
-            new_module->next = p->buf[target_index];
-            p->buf[target_index] = new_module;
-
-            /* increment the counter */
-            ++p->num_modules;
+            _mii_modtable_crawl_insert(c, new_module);
 
             /* skip the other checks and cleanup */
             continue;
         }
 
-        /* add if module, recurse if directory */
+        /* queue directories, the task takes ownership of rel_path */
         if (S_ISDIR(st.st_mode)) {
-            result |= _mii_modtable_gen_recursive_sub(p, root, rel_path);
+            /* directories of the previous index were queued with their own check */
+            if (_mii_modtable_crawl_recorded(c, root, rel_path)) {
+                free(rel_path);
+            } else {
+                _mii_modtable_crawl_push(w, root, rel_path, NULL);
+            }
+
+            continue;
         }
 
         /*
-         * only free these if entry is a non-module, otherwise
+         * only free this if entry is a non-module, otherwise
          * ownership is transferred to the module entry
          */
         free(rel_path);
-        free(abs_path);
     }
 
     closedir(d);
     free(dir_path);
-    return result;
+}
+
+/*
+ * add a crawled module to the table, workers insert one at a time
+ */
+void _mii_modtable_crawl_insert(mii_modtable_crawl* c, mii_modtable_entry* mod) {
+    int target_index = _mii_modtable_get_target_index(mod->path);
+
+    pthread_mutex_lock(&c->lock);
+
+    mod->next = c->table->buf[target_index];
+    c->table->buf[target_index] = mod;
+
+    /* increment the counter */
+    ++c->table->num_modules;
+
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * remember a directory and its times for the next sync
+ * <read> is truthy if its listing was read rather than carried over
+ */
+void _mii_modtable_crawl_record(mii_modtable_crawl* c, const char* root, const char* prefix, const struct stat* st, int read) {
+    mii_modtable* p = c->table;
+    char* prefix_copy = prefix ? mii_strdup(prefix) : NULL;
+
+    pthread_mutex_lock(&c->lock);
+
+    if (p->num_dirs == p->dirs_capacity) {
+        p->dirs_capacity = p->dirs_capacity ? p->dirs_capacity * 2 : 64;
+        p->dirs = realloc(p->dirs, p->dirs_capacity * sizeof *p->dirs);
+    }
+
+    mii_modtable_dir* dir = p->dirs + p->num_dirs++;
+
+    dir->root = root;
+    dir->prefix = prefix_copy;
+    dir->mtime = st->st_mtim;
+    dir->ctime = st->st_ctim;
+
+    if (read) p->dirs_changed = 1;
+
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * queue a directory on the back of a worker's deque
+ * the counters are raised first so the crawl can't look finished while it is queued
+ */
+void _mii_modtable_crawl_push(mii_modtable_crawl_worker* w, const char* root, char* prefix, const mii_index_dir* prev) {
+    pthread_mutex_lock(&w->crawl->lock);
+    ++w->crawl->queued;
+    ++w->crawl->pending;
+    pthread_cond_signal(&w->crawl->work);
+    pthread_mutex_unlock(&w->crawl->lock);
+
+    pthread_mutex_lock(&w->lock);
+
+    if (w->tail == w->capacity) {
+        if (w->head) {
+            /* reuse the room left by stolen tasks */
+            memmove(w->tasks, w->tasks + w->head, (w->tail - w->head) * sizeof *w->tasks);
+            w->tail -= w->head;
+            w->head = 0;
+        } else {
+            w->capacity = w->capacity ? w->capacity * 2 : 64;
+            w->tasks = realloc(w->tasks, w->capacity * sizeof *w->tasks);
+        }
+    }
+
+    w->tasks[w->tail].root = root;
+    w->tasks[w->tail].prefix = prefix;
+    w->tasks[w->tail].prev = prev;
+    ++w->tail;
+
+    pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * take a task from the back of a deque, or from the front when stealing
+ * owners work depth first while thieves take the oldest, usually largest, subtrees
+ */
+int _mii_modtable_crawl_pop(mii_modtable_crawl_worker* w, mii_modtable_crawl_task* task, int steal) {
+    int found = 0;
+
+    pthread_mutex_lock(&w->lock);
+
+    if (w->head < w->tail) {
+        *task = steal ? w->tasks[w->head++] : w->tasks[--w->tail];
+        if (w->head == w->tail) w->head = w->tail = 0;
+        found = 1;
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    if (found) {
+        pthread_mutex_lock(&w->crawl->lock);
+        --w->crawl->queued;
+        pthread_mutex_unlock(&w->crawl->lock);
+    }
+
+    return found;
+}
+
+/*
+ * find the next directory for a worker, 0 once every directory is crawled
+ */
+int _mii_modtable_crawl_take(mii_modtable_crawl_worker* w, mii_modtable_crawl_task* task) {
+    mii_modtable_crawl* c = w->crawl;
+
+    while (1) {
+        if (_mii_modtable_crawl_pop(w, task, 0)) return 1;
+
+        for (int i = 1; i < c->num_workers; ++i) {
+            if (_mii_modtable_crawl_pop(c->workers + (w->id + i) % c->num_workers, task, 1)) return 1;
+        }
+
+        /* nothing to steal, sleep until a directory is queued or the crawl ends */
+        pthread_mutex_lock(&c->lock);
+        while (!c->queued && c->pending) pthread_cond_wait(&c->work, &c->lock);
+        int done = !c->pending;
+        pthread_mutex_unlock(&c->lock);
+
+        if (done) return 0;
+    }
+}
+
+void* _mii_modtable_crawl_worker_run(void* arg) {
+    mii_modtable_crawl_worker* w = arg;
+    mii_modtable_crawl_task task;
+
+    while (_mii_modtable_crawl_take(w, &task)) {
+        _mii_modtable_crawl_dir(w, task.root, task.prefix, task.prev);
+        free(task.prefix);
+
+        /* subdirectories were counted while crawling, so this can only reach 0 at the end */
+        pthread_mutex_lock(&w->crawl->lock);
+        if (!--w->crawl->pending) pthread_cond_broadcast(&w->crawl->work);
+        pthread_mutex_unlock(&w->crawl->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * map the previous index and sort its directories and modules for lookups
+ * without an index which recorded its directories, every directory is read
+ */
+int _mii_modtable_crawl_prev_init(mii_modtable_crawl* c, const char* prev_path) {
+    /* a missing index isn't an error, the first sync has none */
+    if (!prev_path || access(prev_path, R_OK)) return -1;
+
+    /* legacy indices and indices from before directories were recorded have nothing to reuse */
+    if (mii_index_map(&c->prev, prev_path) || !c->prev.num_dirs) {
+        mii_index_unmap(&c->prev);
+        return -1;
+    }
+
+    c->prev_dirs = malloc(c->prev.num_dirs * sizeof *c->prev_dirs);
+
+    for (uint32_t i = 0; i < c->prev.num_dirs; ++i) {
+        mii_modtable_prev_key* key = c->prev_dirs + c->num_prev_dirs++;
+
+        key->root = mii_index_string(&c->prev, c->prev.dirs[i].root);
+        key->prefix = mii_index_string(&c->prev, c->prev.dirs[i].prefix);
+        key->root_len = strlen(key->root);
+        key->prefix_len = strlen(key->prefix);
+        key->id = i;
+    }
+
+    /* crawled modules are at <root>/<code>, the directory is the code up to its last slash */
+    if (c->prev.num_modules) c->prev_modules = malloc(c->prev.num_modules * sizeof *c->prev_modules);
+
+    for (uint32_t i = 0; i < c->prev.num_modules; ++i) {
+        const mii_index_module* mod = c->prev.modules + i;
+        const char* path = mii_index_string(&c->prev, mod->path), *code = mii_index_string(&c->prev, mod->code);
+
+        size_t path_len = strlen(path), code_len = strlen(code);
+        size_t name_len = code_len + (mod->type == MII_MODTABLE_MODTYPE_LMOD ? 4 : 0);
+
+        /* a module which wasn't crawled can't be found in a directory */
+        if (path_len <= name_len || path[path_len - name_len - 1] != '/' || strncmp(path + path_len - name_len, code, code_len)) continue;
+
+        const char* slash = strrchr(code, '/');
+        mii_modtable_prev_key* key = c->prev_modules + c->num_prev_modules++;
+
+        key->root = path;
+        key->root_len = path_len - name_len - 1;
+        key->prefix = code;
+        key->prefix_len = slash ? (size_t) (slash - code) : 0;
+        key->id = i;
+    }
+
+    qsort(c->prev_dirs, c->num_prev_dirs, sizeof *c->prev_dirs, _mii_modtable_prev_compare);
+    if (c->num_prev_modules) qsort(c->prev_modules, c->num_prev_modules, sizeof *c->prev_modules, _mii_modtable_prev_compare);
+
+    mii_debug("Checking %u directories and %u modules from %s", c->num_prev_dirs, c->num_prev_modules, prev_path);
+    return 0;
+}
+
+void _mii_modtable_crawl_prev_free(mii_modtable_crawl* c) {
+    free(c->prev_dirs);
+    free(c->prev_modules);
+    mii_index_unmap(&c->prev);
+}
+
+/*
+ * insert the modules the previous index found in an unchanged directory
+ * they keep their old timestamps, so preanalysis takes their bins as well
+ */
+void _mii_modtable_crawl_carry(mii_modtable_crawl* c, const char* root, const char* prefix) {
+    mii_modtable_prev_key key = { root, prefix ? prefix : "", strlen(root), prefix ? strlen(prefix) : 0, 0 };
+
+    for (uint32_t i = _mii_modtable_prev_find(c->prev_modules, c->num_prev_modules, &key); i < c->num_prev_modules; ++i) {
+        if (_mii_modtable_prev_compare(c->prev_modules + i, &key)) break;
+
+        const mii_index_module* mod = c->prev.modules + c->prev_modules[i].id;
+        mii_modtable_entry* new_module = malloc(sizeof *new_module);
+
+        new_module->path = mii_strdup(mii_index_string(&c->prev, mod->path));
+        new_module->code = mii_strdup(mii_index_string(&c->prev, mod->code));
+        new_module->type = mod->type;
+        new_module->timestamp = mod->timestamp;
+        new_module->bins = NULL;
+        new_module->num_bins = 0;
+        new_module->parents = NULL;
+        new_module->num_parents = 0;
+        new_module->dirs = NULL;
+        new_module->num_dirs = 0;
+        new_module->uses = NULL;
+        new_module->num_uses = 0;
+        new_module->root = _mii_modtable_crawl_root(c, root);
+        new_module->analysis_complete = 0;
+
+        _mii_modtable_crawl_insert(c, new_module);
+    }
+}
+
+/*
+ * check if a directory is in the previous index
+ */
+int _mii_modtable_crawl_recorded(mii_modtable_crawl* c, const char* root, const char* prefix) {
+    mii_modtable_prev_key key = { root, prefix, strlen(root), strlen(prefix), 0 };
+    uint32_t i = _mii_modtable_prev_find(c->prev_dirs, c->num_prev_dirs, &key);
+
+    return i < c->num_prev_dirs && !_mii_modtable_prev_compare(c->prev_dirs + i, &key);
+}
+
+/*
+ * order keys by root, then by directory
+ */
+int _mii_modtable_prev_compare(const void* a, const void* b) {
+    const mii_modtable_prev_key* ka = a, *kb = b;
+
+    int res = memcmp(ka->root, kb->root, ka->root_len < kb->root_len ? ka->root_len : kb->root_len);
+    if (res) return res;
+    if (ka->root_len != kb->root_len) return ka->root_len < kb->root_len ? -1 : 1;
+
+    res = memcmp(ka->prefix, kb->prefix, ka->prefix_len < kb->prefix_len ? ka->prefix_len : kb->prefix_len);
+    if (res) return res;
+    if (ka->prefix_len != kb->prefix_len) return ka->prefix_len < kb->prefix_len ? -1 : 1;
+
+    return 0;
+}
+
+/*
+ * find the first key not ordered before <key>, <count> if there is none
+ */
+uint32_t _mii_modtable_prev_find(const mii_modtable_prev_key* keys, uint32_t count, const mii_modtable_prev_key* key) {
+    uint32_t lo = 0, hi = count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (_mii_modtable_prev_compare(keys + mid, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
 }
 
 /*
@@ -450,7 +1247,100 @@ int _mii_modtable_gen_recursive_sub(mii_modtable* p, const char* root, const cha
  * <handler> is called for each imported module with allocated module info
  * if the handler returns nonzero this function is interrupted and returns immediately
  */
-int _mii_modtable_parse_from(mii_modtable* p, const char* path, int (*handler)(mii_modtable* p, char* path, char* code, char** bins, int num_bins, char** parents, int num_parents, time_t timestamp)) {
+int _mii_modtable_parse_from(mii_modtable* p, const char* path, mii_modtable_parse_handler handler) {
+    mii_index idx;
+    int res = mii_index_map(&idx, path);
+
+    if (res == MII_INDEX_LEGACY) {
+        mii_info("Migrating legacy index %s", path);
+        p->legacy_import = 1;
+
+        return _mii_modtable_parse_legacy(p, path, handler);
+    }
+
+    if (res) return res;
+
+    res = _mii_modtable_parse_mapped(p, &idx, handler);
+    mii_index_unmap(&idx);
+
+    return res;
+}
+
+/*
+ * copy each module out of a mapped index and pass it to <handler>
+ */
+int _mii_modtable_parse_mapped(mii_modtable* p, mii_index* idx, mii_modtable_parse_handler handler) {
+    int res = 0;
+
+    for (uint32_t i = 0; i < idx->num_modules && !res; ++i) {
+        const mii_index_module* mod = idx->modules + i;
+
+        char** mod_bins = NULL;
+        if (mod->num_bins) mod_bins = malloc(mod->num_bins * sizeof *mod_bins);
+
+        for (uint32_t j = 0; j < mod->num_bins; ++j) {
+            mod_bins[j] = mii_strdup(mii_index_string(idx, idx->bins[mod->bins + j]));
+        }
+
+        char** mod_parents = NULL;
+        if (mod->num_parents) mod_parents = malloc(mod->num_parents * sizeof *mod_parents);
+
+        for (uint32_t j = 0; j < mod->num_parents; ++j) {
+            mod_parents[j] = mii_strdup(mii_index_string(idx, idx->parents[mod->parents + j]));
+        }
+
+        /* the PATH directories are kept if the index recorded them for every bin */
+        mii_modtable_bin_dir* mod_dirs = NULL;
+        uint32_t num_dirs = 0;
+
+        if (idx->module_dirs) {
+            const mii_index_module_dirs* range = idx->module_dirs + i;
+
+            num_dirs = range->num_dirs;
+            if (num_dirs) mod_dirs = malloc(num_dirs * sizeof *mod_dirs);
+
+            for (uint32_t j = 0; j < num_dirs; ++j) {
+                const mii_index_bin_dir* dir = idx->bin_dirs + range->dirs + j;
+
+                mod_dirs[j].path = mii_strdup(mii_index_string(idx, dir->path));
+                mod_dirs[j].mtime.tv_sec = dir->mtime_sec;
+                mod_dirs[j].mtime.tv_nsec = dir->mtime_nsec;
+                mod_dirs[j].num_bins = dir->num_bins;
+            }
+        }
+
+        char** mod_uses = NULL;
+        uint32_t num_uses = 0;
+
+        if (idx->module_uses) {
+            const mii_index_module_uses* range = idx->module_uses + i;
+
+            num_uses = range->num_uses;
+            if (num_uses) mod_uses = malloc(num_uses * sizeof *mod_uses);
+
+            for (uint32_t j = 0; j < num_uses; ++j) {
+                mod_uses[j] = mii_strdup(mii_index_string(idx, idx->uses[range->uses + j]));
+            }
+        }
+
+        res = handler(p,
+                      mii_strdup(mii_index_string(idx, mod->path)),
+                      mii_strdup(mii_index_string(idx, mod->code)),
+                      mod_bins, mod->num_bins,
+                      mod_parents, mod->num_parents,
+                      mod_dirs, num_dirs,
+                      mod_uses, num_uses,
+                      mod->timestamp);
+    }
+
+    return res;
+}
+
+/*
+ * parse a modtable in the legacy 0xBEE5 format
+ * kept so existing indices can be migrated by a sync
+ */
+int _mii_modtable_parse_legacy(mii_modtable* p, const char* path, mii_modtable_parse_handler handler) {
     int res, num_modules;
 
     res = 0;
@@ -576,7 +1466,7 @@ int _mii_modtable_parse_from(mii_modtable* p, const char* path, int (*handler)(m
         }
 
         /* that's all we need! call the handler */
-        if ((res = handler(p, mod_path, mod_code, mod_bins, mod_num_bins, mod_parents, mod_num_parents, mod_timestamp))) {
+        if ((res = handler(p, mod_path, mod_code, mod_bins, mod_num_bins, mod_parents, mod_num_parents, NULL, 0, NULL, 0, mod_timestamp))) {
             break;
         }
     }
@@ -587,33 +1477,11 @@ int _mii_modtable_parse_from(mii_modtable* p, const char* path, int (*handler)(m
     /* Catch all read errors here */
     unexpected_eof:
     mii_error("Couldn't parse from %s: unexpected EOF or read fail\n", path);
+    fclose(f);
     return -1;
 }
 
-int _mii_modtable_parse_handler_import(mii_modtable* p, char* path, char* code, char** bins, int num_bins, char** parents, int num_parents, time_t timestamp) {
-    /* import: just insert every module into the modtable and don't worry too much */
-    int target_index = _mii_modtable_get_target_index(path);
-
-    mii_modtable_entry* new_entry = malloc(sizeof *new_entry);
-
-    new_entry->path = path;
-    new_entry->code = code;
-    new_entry->bins = bins;
-    new_entry->num_bins = num_bins;
-    new_entry->parents = parents;
-    new_entry->num_parents = num_parents;
-    new_entry->timestamp = timestamp;
-    new_entry->next = p->buf[target_index];
-    new_entry->analysis_complete = 1;
-
-    p->buf[target_index] = new_entry;
-    ++p->num_modules;
-
-    mii_debug("Imported module: path %s, code %s, %d bins", path, code, num_bins);
-    return 0;
-}
-
-int _mii_modtable_parse_handler_preanalysis(mii_modtable* p, char* path, char* code, char** bins, int num_bins, char** parents, int num_parents, time_t timestamp) {
+int _mii_modtable_parse_handler_preanalysis(mii_modtable* p, char* path, char* code, char** bins, int num_bins, char** parents, int num_parents, mii_modtable_bin_dir* dirs, int num_dirs, char** uses, int num_uses, time_t timestamp) {
     /* preanalysis phase
      * locate any matching modules and check if they are up to date.
      * if so, then prefill the binary list.
@@ -621,7 +1489,8 @@ int _mii_modtable_parse_handler_preanalysis(mii_modtable* p, char* path, char* c
 
     mii_modtable_entry* mod = _mii_modtable_locate_entry(p, path);
 
-    if (mod && (mod->timestamp <= timestamp)) {
+    /* modules crawled in an earlier round of the hierarchy were already handled */
+    if (mod && !mod->analysis_complete && (mod->timestamp <= timestamp)) {
         /* found a matching module, and the timestamp in the db is up to date.
          * pass over the bins */
 
@@ -629,12 +1498,23 @@ int _mii_modtable_parse_handler_preanalysis(mii_modtable* p, char* path, char* c
         mod->num_bins = num_bins;
         mod->parents = parents;
         mod->num_parents = num_parents;
+        mod->dirs = dirs;
+        mod->num_dirs = num_dirs;
+        mod->uses = uses;
+        mod->num_uses = num_uses;
         mod->analysis_complete = 1;
 
         --p->modules_requiring_analysis;
     } else {
         /* didn't find anything. free the bins */
+        for (int i = 0; i < num_bins; ++i) free(bins[i]);
+        for (int i = 0; i < num_parents; ++i) free(parents[i]);
+        for (int i = 0; i < num_uses; ++i) free(uses[i]);
+
         free(bins);
+        free(parents);
+        free(uses);
+        _mii_modtable_free_dirs(dirs, num_dirs);
     }
 
     /* free everything else too */
@@ -644,6 +1524,11 @@ int _mii_modtable_parse_handler_preanalysis(mii_modtable* p, char* path, char* c
     return 0;
 }
 
+void _mii_modtable_free_dirs(mii_modtable_bin_dir* dirs, int num_dirs) {
+    for (int i = 0; i < num_dirs; ++i) free(dirs[i].path);
+    free(dirs);
+}
+
 /*
  * compute the hash index for a path, modulo the hash table width
  */
@@ -670,13 +1555,21 @@ mii_modtable_entry* _mii_modtable_locate_entry(mii_modtable* p, const char* path
 #if MII_ENABLE_SPIDER
 
 /* generate the index using the spider command provided by Lmod */
-int mii_modtable_spider_gen(mii_modtable* p, const char* path, int* count) {
+int mii_modtable_spider_gen(mii_modtable* p, const char* path, const char* prev_path, int* count) {
     char* lmod_dir = getenv("LMOD_DIR");
     if (lmod_dir == NULL || strlen(lmod_dir) == 0) {
         mii_error("Couldn't find Lmod's directory. Please set LMOD_DIR.");
         return -1;
     }
 
+    /*
+     * the previous index is loaded first, its modules wait in the table until spider lists them again
+     * a missing or broken index only means every modulefile is scanned
+     */
+    if (prev_path && _mii_modtable_parse_from(p, prev_path, _mii_modtable_parse_handler_spider)) {
+        mii_warn("Couldn't read the previous index, will scan every modulefile");
+    }
+
     /* generate the spider command and run it */
     char* cmd = malloc(strlen(lmod_dir)+ strlen(path) + 24);
     sprintf(cmd, "%s/%s %s", lmod_dir, "spider -o spider-json", path);
@@ -691,69 +1584,221 @@ int mii_modtable_spider_gen(mii_modtable* p, const char* path, int* count) {
     free(cmd);
 
     char buf[MII_MODTABLE_BUF_SIZE];
-    char* unparsed_json = NULL;
     size_t json_len = 0;
+    int res = 0;
 
-    /* read buffered cmd output */
-    for (size_t len = 0; (len = fread(buf, 1, sizeof(buf), pf)) > 0; json_len += len) {
-        unparsed_json = (char*) realloc(unparsed_json, json_len + len);
+    mii_modtable_spider_reader reader;
+    memset(&reader, 0, sizeof reader);
 
-        if (unparsed_json == NULL) {
-            mii_error("Couldn't allocate memory for JSON: %s", strerror(errno));
-            pclose(pf);
-            return -1;
-        }
+    /* modules share most of their PATH directories, each is scanned or stat()ed once */
+    mii_analysis_cache cache;
+    mii_analysis_state state;
+
+    mii_analysis_cache_init(&cache);
+    mii_analysis_init(&state, &cache);
 
-        memcpy(unparsed_json + json_len, buf, len);
+    /* modulefiles are analyzed as soon as spider has written them out */
+    for (size_t len = 0; !res && (len = fread(buf, 1, sizeof(buf), pf)) > 0; json_len += len) {
+        res = _mii_modtable_spider_feed(p, &reader, &state, buf, len);
     }
-    pclose(pf);
 
-    /* replace newline by end of str */
-    unparsed_json[--json_len] = '\0';
+    int status = pclose(pf);
+    mii_analysis_free(&state);
+    mii_analysis_cache_free(&cache);
+    free(reader.record);
 
-    if (unparsed_json == NULL) {
+    if (res) return -1;
+
+    /* a failed spider would otherwise drop every module below */
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        mii_error("Spider exited with an error, keeping the previous index.");
+        return -1;
+    }
+
+    if (!json_len) {
         mii_error("The returned JSON was empty.");
-        free(unparsed_json);
         return -1;
     }
 
-    /* parse the json */
-    cJSON* json = cJSON_Parse(unparsed_json);
-    free(unparsed_json);
+    if (reader.depth || reader.in_string || !reader.closed) {
+        mii_error("The returned JSON ended early.");
+        return -1;
+    }
 
-    if (json == NULL) {
+    /* modulefiles of the previous index which spider didn't list anymore */
+    if (_mii_modtable_spider_drop_stale(p)) p->dirs_changed = 1;
+
+    *count = reader.count;
+
+    return 0;
+}
+
+/*
+ * scan a chunk of spider-json, analyzing every modulefile record completed in it
+ * a record starts at a key two objects deep and runs to the next separator at that depth
+ */
+int _mii_modtable_spider_feed(mii_modtable* p, mii_modtable_spider_reader* r, mii_analysis_state* s, const char* data, size_t len) {
+    const char* run = data; /* start of the record's bytes in this chunk */
+
+    for (size_t i = 0; i < len; ++i) {
+        char c = data[i];
+
+        if (r->in_string) {
+            if (r->escape) r->escape = 0;
+            else if (c == '\\') r->escape = 1;
+            else if (c == '"') r->in_string = 0;
+
+            continue;
+        }
+
+        if (c == '"') {
+            r->in_string = 1;
+
+            if (r->depth == 2 && !r->in_record) {
+                /* wrapped in braces the record parses as an object on its own */
+                r->in_record = 1;
+                r->len = 0;
+                _mii_modtable_spider_append(r, "{", 1);
+                run = data + i;
+            }
+        } else if (c == '{' || c == '[') {
+            ++r->depth;
+        } else if ((c == '}' || c == ']' || c == ',') && r->depth == 2 && r->in_record) {
+            _mii_modtable_spider_append(r, run, data + i - run);
+            _mii_modtable_spider_append(r, "}", 2);
+            r->in_record = 0;
+
+            if (_mii_modtable_spider_record(p, r, s)) return -1;
+        }
+
+        if (c == '}' || c == ']') {
+            if (--r->depth == 0 && c == '}') r->closed = 1;
+        }
+    }
+
+    if (r->in_record) _mii_modtable_spider_append(r, run, data + len - run);
+
+    return 0;
+}
+
+/*
+ * parse and analyze the modulefile record read last
+ * a module of the previous index is replaced, keeping its bins if the modulefile didn't change
+ */
+int _mii_modtable_spider_record(mii_modtable* p, mii_modtable_spider_reader* r, mii_analysis_state* s) {
+    cJSON* json = cJSON_Parse(r->record);
+
+    if (json == NULL || json->child == NULL) {
         mii_error("Couldn't parse JSON : %s", cJSON_GetErrorPtr());
+        cJSON_Delete(json);
         return -1;
     }
 
-    /* iterate over every modulefile found by the spider */
-    for (cJSON* module = json->child; module != NULL; module = module->next) {
-        for (cJSON* modulefile = module->child; modulefile != NULL; modulefile = modulefile->next) {
-            /* allocate memory and get info */
-            mii_modtable_entry* new_module = malloc(sizeof *new_module);
+    /* entries of the previous index are the ones not complete yet */
+    mii_modtable_entry* prev = _mii_modtable_locate_entry(p, json->child->string);
+    if (prev && prev->analysis_complete) prev = NULL;
 
-            if(mii_analysis_parse_module_json(modulefile, new_module)) {
-                mii_error("Couldn't parse JSON for module %s", modulefile->string);
-                free(new_module);
-                return -1;
-            }
+    /* allocate memory and get info */
+    mii_modtable_entry* new_module = malloc(sizeof *new_module);
+    int res = mii_analysis_parse_module_json(s->cache, json->child, new_module, prev);
 
-            mii_debug("analysis for %s : %d bins", new_module->path, new_module->num_bins);
+    if (res < 0) {
+        mii_error("Couldn't parse JSON for module %s", json->child->string);
+        cJSON_Delete(json);
+        free(new_module);
+        return -1;
+    }
 
-            /* add to the modtable */
-            int target_index = _mii_modtable_get_target_index(new_module->path);
-            new_module->next = p->buf[target_index];
-            p->buf[target_index] = new_module;
+    if (!res || mii_analysis_refresh(s, new_module)) ++r->count;
 
-            /* increment the counter */
-            ++p->num_modules;
-        }
+    mii_debug("%s for %s : %d bins", res ? "reused analysis" : "analysis", new_module->path, new_module->num_bins);
+
+    if (prev) {
+        int prev_index = _mii_modtable_get_target_index(prev->path);
+        mii_modtable_entry** link = p->buf + prev_index;
+
+        while (*link != prev) link = &(*link)->next;
+        *link = prev->next;
+
+        _mii_modtable_free_entry(prev);
     }
+
+    /* add to the modtable */
+    int target_index = _mii_modtable_get_target_index(new_module->path);
+    new_module->next = p->buf[target_index];
+    p->buf[target_index] = new_module;
+
+    /* increment the counter */
+    ++p->num_modules;
+
     cJSON_Delete(json);
+    return 0;
+}
+
+/*
+ * remove the modules of the previous index spider didn't list, returns how many there were
+ */
+int _mii_modtable_spider_drop_stale(mii_modtable* p) {
+    int dropped = 0;
+
+    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
+        mii_modtable_entry** link = p->buf + i;
+
+        while (*link) {
+            mii_modtable_entry* cur = *link;
+
+            if (cur->analysis_complete) {
+                link = &cur->next;
+                continue;
+            }
+
+            mii_debug("%s is gone, dropping it", cur->path);
+
+            *link = cur->next;
+            _mii_modtable_free_entry(cur);
+            ++dropped;
+        }
+    }
 
-    *count = p->num_modules;
+    return dropped;
+}
+
+/*
+ * keep a module of the previous index in the table until spider lists it
+ */
+int _mii_modtable_parse_handler_spider(mii_modtable* p, char* path, char* code, char** bins, int num_bins, char** parents, int num_parents, mii_modtable_bin_dir* dirs, int num_dirs, char** uses, int num_uses, time_t timestamp) {
+    mii_modtable_entry* mod = malloc(sizeof *mod);
+
+    mod->path = path;
+    mod->code = code;
+    mod->type = MII_MODTABLE_MODTYPE_LMOD;
+    mod->timestamp = timestamp;
+    mod->bins = bins;
+    mod->num_bins = num_bins;
+    mod->parents = parents;
+    mod->num_parents = num_parents;
+    mod->dirs = dirs;
+    mod->num_dirs = num_dirs;
+    mod->uses = uses;
+    mod->num_uses = num_uses;
+    mod->root = -1;
+    mod->analysis_complete = 0; /* not listed by spider yet */
+
+    int target_index = _mii_modtable_get_target_index(path);
+    mod->next = p->buf[target_index];
+    p->buf[target_index] = mod;
 
     return 0;
 }
 
+void _mii_modtable_spider_append(mii_modtable_spider_reader* r, const char* data, size_t len) {
+    if (r->len + len > r->capacity) {
+        while (r->len + len > r->capacity) r->capacity = r->capacity ? r->capacity * 2 : MII_MODTABLE_BUF_SIZE;
+        r->record = realloc(r->record, r->capacity);
+    }
+
+    memcpy(r->record + r->len, data, len);
+    r->len += len;
+}
+
 #endif
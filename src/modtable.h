@@ -9,6 +9,7 @@
 
 #include <time.h>
 
+#include "index.h"
 #include "search_result.h"
 
 /* modulo for the hashtable, preferably a power of 2 */
@@ -24,35 +25,80 @@
 #define MII_MODTABLE_SPIDER_CMD ""
 #define MII_MODTABLE_BUF_SIZE 4096
 
+/*
+ * a PATH directory a module's bins were read from
+ * each directory contributes a run of bins, in the order of the directories
+ */
+typedef struct _mii_modtable_bin_dir {
+    char* path;
+    struct timespec mtime; /* tv_sec is -1 if the directory wasn't found */
+    int num_bins;
+} mii_modtable_bin_dir;
+
 typedef struct _mii_modtable_entry {
     char* path, *code;
-    int type, num_bins, num_parents;
+    int type, num_bins, num_parents, num_dirs;
     char** bins, **parents;
+    mii_modtable_bin_dir* dirs; /* NULL if the bins came from an index which didn't record them */
+    char** uses; /* MODULEPATH directories the module adds */
+    int num_uses;
+    int root; /* the table root the module was found in, -1 if it wasn't crawled */
     time_t timestamp;
     int analysis_complete; /* truthy if the bin list is confirmed to be complete */
     struct _mii_modtable_entry* next;
 } mii_modtable_entry;
 
+/* a directory read by the crawler, written to the index with its times */
+typedef struct _mii_modtable_dir {
+    const char* root; /* one of the table's roots */
+    char* prefix;     /* path relative to the root, NULL for the root itself */
+    struct timespec mtime, ctime;
+} mii_modtable_dir;
+
 typedef struct _mii_modtable {
     int analysis_complete, num_modules, modules_requiring_analysis;
+    int legacy_import; /* truthy if preanalysis read a legacy format index */
+    int dirs_changed; /* truthy if gen read any directory or dropped any module of the previous index */
+    int num_dirs, dirs_capacity;
+    mii_modtable_dir* dirs;
+    uint32_t num_prev_dirs; /* directories recorded by the previous index */
     mii_modtable_entry* buf[MII_MODTABLE_HASHTABLE_WIDTH];
+    mii_index map; /* imported index, searches are answered from here */
     char* modulepath; /* split into chunks on init via strtok() */
+    char** roots; /* crawled directories, the first num_base_roots are the chunks of modulepath */
+    int num_roots, num_base_roots, roots_capacity;
 } mii_modtable;
 
 void mii_modtable_init(mii_modtable* p);
 void mii_modtable_free(mii_modtable* p);
 
-int mii_modtable_gen(mii_modtable* p, char* modulepath); /* scan for modules and build a partial table */
-int mii_modtable_import(mii_modtable* p, const char* path); /* import an existing table from the disk */
+/*
+ * scan for modules with <threads> crawlers and build a partial table
+ * directories unchanged since the index at <prev_path> aren't read again, NULL crawls everything
+ */
+int mii_modtable_gen(mii_modtable* p, char* modulepath, int threads, const char* prev_path);
+int mii_modtable_import(mii_modtable* p, const char* path); /* map an existing table from the disk, MII_INDEX_LEGACY if it must be migrated */
 
 #if MII_ENABLE_SPIDER
-int mii_modtable_spider_gen(mii_modtable* p, const char* path, int* count);
+/*
+ * build the table from Lmod's spider, <count> modules are scanned or patched
+ * modulefiles unchanged since the index at <prev_path> keep their bins, NULL scans everything
+ */
+int mii_modtable_spider_gen(mii_modtable* p, const char* path, const char* prev_path, int* count);
 #endif
 
 int mii_modtable_preanalysis(mii_modtable* p, const char* path); /* preanalyze up-to-date modules */
-int mii_modtable_analysis(mii_modtable* p, int* count); /* perform analysis on all required modules */
+int mii_modtable_analysis(mii_modtable* p, int threads, int* count); /* perform analysis on all required modules with <threads> workers */
+
+/*
+ * crawl and analyze the MODULEPATH directories added by analyzed modules until no new ones show up,
+ * then fill in the parents of every module, <count> more modules are analyzed or patched
+ * finishes a gen, directories of the index at <prev_path> which went away are only noticed here
+ */
+int mii_modtable_hierarchy(mii_modtable* p, int threads, const char* prev_path, int* count);
 int mii_modtable_export(mii_modtable* p, const char* output_path); /* export table to disk, overwriting */
 
-int mii_modtable_search_exact(mii_modtable* p, const char* cmd, mii_search_result* res);
-int mii_modtable_search_similar(mii_modtable* p, const char* cmd, mii_search_result* res);
+/* results are ranked against <loaded_modules>, a LOADEDMODULES list which may be NULL */
+int mii_modtable_search_exact(mii_modtable* p, const char* cmd, const char* loaded_modules, mii_search_result* res);
+int mii_modtable_search_similar(mii_modtable* p, const char* cmd, int limit, int limit_mode, const char* loaded_modules, mii_search_result* res); /* keep only the best <limit> results */
 int mii_modtable_search_info(mii_modtable* p, const char* code, mii_search_result* res);
@@ -11,8 +11,15 @@
 /* sorting helper functions */
 void _mii_search_result_swap(mii_search_result* res, int a, int b);
 int _mii_search_result_compare(mii_search_result* res, int a, int b);
-int _mii_search_result_compare_codes(const char* code_a, const char* code_b);
-int _mii_search_result_get_priority(const char* parents, const char* code);
+
+/* result storage helpers */
+void _mii_search_result_reserve(mii_search_result* p, int capacity);
+void _mii_search_result_set(mii_search_result* p, int slot, const char* code, const char* key, const char* bin, int distance, const char* parents, int priority);
+
+/* limited result helpers */
+void _mii_search_result_add_limited(mii_search_result* p, const char* code, const char* key, const char* bin, int distance, const char* parents, int priority);
+void _mii_search_result_sift_up(mii_search_result* p, int slot);
+void _mii_search_result_sift_down(mii_search_result* p, int slot, int size);
 
 int mii_search_result_init(mii_search_result* dest, const char* query) {
     memset(dest, 0, sizeof *dest);
@@ -20,43 +27,133 @@ int mii_search_result_init(mii_search_result* dest, const char* query) {
     return 0;
 }
 
-void mii_search_result_free(mii_search_result* dest) {
-    /* drop allocated result values */
-    for (int i = 0; i < dest->num_results; ++i) {
-        free(dest->codes[i]);
-        free(dest->bins[i]);
-        free(dest->parents[i]);
-    }
+int mii_search_result_init_limited(mii_search_result* dest, const char* query, int limit, int mode) {
+    mii_search_result_init(dest, query);
+
+    if (limit <= 0) return 0;
+
+    dest->limit = limit;
+    dest->limit_mode = mode;
 
+    /* the results are a heap with the worst on top, one extra slot stages each candidate */
+    _mii_search_result_reserve(dest, limit + 1);
+
+    return 0;
+}
+
+void mii_search_result_free(mii_search_result* dest) {
+    /* result strings are borrowed, only the arrays are owned */
     free(dest->query);
+    free(dest->strings);
 
-    /* drop result arrays */
     free(dest->codes);
+    free(dest->keys);
     free(dest->bins);
     free(dest->parents);
     free(dest->distances);
     free(dest->priorities);
 }
 
-void mii_search_result_add(mii_search_result* p, const char* code, const char* bin, int distance, const char* parents) {
-    ++p->num_results;
-
-    /* resize result arrays */
-    p->codes = realloc(p->codes, p->num_results * sizeof *p->codes);
-    p->bins = realloc(p->bins, p->num_results * sizeof *p->bins);
-    p->distances = realloc(p->distances, p->num_results * sizeof *p->distances);
-    p->parents = realloc(p->parents, p->num_results * sizeof *p->parents);
-    p->priorities = realloc(p->priorities, p->num_results * sizeof *p->priorities);
-
-    /* duplicate code/bin and insert into results */
-    p->codes[p->num_results - 1] = mii_strdup(code);
-    p->bins[p->num_results - 1] = mii_strdup(bin);
-    p->distances[p->num_results - 1] = distance;
-    p->parents[p->num_results - 1] = (parents != NULL) ? mii_strdup(parents) : mii_strdup("");
-    p->priorities[p->num_results - 1] = _mii_search_result_get_priority(parents, code);
+void mii_search_result_add(mii_search_result* p, const char* code, const char* key, const char* bin, int distance, const char* parents, int priority) {
+    ++p->num_matches;
+
+    if (p->limit) {
+        _mii_search_result_add_limited(p, code, key, bin, distance, parents, priority);
+        return;
+    }
+
+    /* grow geometrically so adding stays amortized constant time */
+    if (p->num_results == p->capacity) {
+        _mii_search_result_reserve(p, p->capacity ? p->capacity * 2 : 16);
+    }
+
+    _mii_search_result_set(p, p->num_results++, code, key, bin, distance, parents, priority);
+}
+
+void _mii_search_result_reserve(mii_search_result* p, int capacity) {
+    p->capacity = capacity;
+
+    p->codes = realloc(p->codes, capacity * sizeof *p->codes);
+    p->keys = realloc(p->keys, capacity * sizeof *p->keys);
+    p->bins = realloc(p->bins, capacity * sizeof *p->bins);
+    p->distances = realloc(p->distances, capacity * sizeof *p->distances);
+    p->parents = realloc(p->parents, capacity * sizeof *p->parents);
+    p->priorities = realloc(p->priorities, capacity * sizeof *p->priorities);
+}
+
+void _mii_search_result_set(mii_search_result* p, int slot, const char* code, const char* key, const char* bin, int distance, const char* parents, int priority) {
+    p->codes[slot] = code;
+    p->keys[slot] = key;
+    p->bins[slot] = bin;
+    p->distances[slot] = distance;
+    p->parents[slot] = (parents != NULL) ? parents : "";
+    p->priorities[slot] = priority;
+}
+
+void _mii_search_result_add_limited(mii_search_result* p, const char* code, const char* key, const char* bin, int distance, const char* parents, int priority) {
+    int full = p->num_results == p->limit, stage = p->limit, slot = -1;
+
+    /* distance is compared first, most candidates are dropped right away */
+    if (full && distance > p->distances[0]) return;
+
+    _mii_search_result_set(p, stage, code, key, bin, distance, parents, priority);
+
+    if (p->limit_mode == MII_SEARCH_RESULT_LIMIT_BINS) {
+        for (int i = 0; i < p->num_results; ++i) {
+            if (!strcmp(p->bins[i], bin)) {
+                slot = i;
+                break;
+            }
+        }
+
+        /* a bin is only replaced by a better result for it */
+        if (slot >= 0 && _mii_search_result_compare(p, stage, slot) >= 0) return;
+    }
+
+    if (slot < 0 && !full) {
+        slot = p->num_results++;
+        _mii_search_result_swap(p, slot, stage);
+        _mii_search_result_sift_up(p, slot);
+        return;
+    }
+
+    /* otherwise the candidate must beat the worst result kept */
+    if (slot < 0) {
+        if (_mii_search_result_compare(p, stage, 0) >= 0) return;
+        slot = 0;
+    }
+
+    /* the replacement is better, so it can only move away from the top */
+    _mii_search_result_swap(p, slot, stage);
+    _mii_search_result_sift_down(p, slot, p->num_results);
+}
+
+void _mii_search_result_sift_up(mii_search_result* p, int slot) {
+    while (slot > 0) {
+        int parent = (slot - 1) / 2;
+
+        if (_mii_search_result_compare(p, slot, parent) <= 0) break;
+
+        _mii_search_result_swap(p, slot, parent);
+        slot = parent;
+    }
+}
+
+void _mii_search_result_sift_down(mii_search_result* p, int slot, int size) {
+    for (;;) {
+        int worst = slot, left = 2 * slot + 1, right = left + 1;
+
+        if (left < size && _mii_search_result_compare(p, left, worst) > 0) worst = left;
+        if (right < size && _mii_search_result_compare(p, right, worst) > 0) worst = right;
+
+        if (worst == slot) break;
+
+        _mii_search_result_swap(p, slot, worst);
+        slot = worst;
+    }
 }
 
-int mii_search_result_next(mii_search_result* p, char** code, char** bin, char** parent, int* distance) {
+int mii_search_result_next(mii_search_result* p, const char** code, const char** bin, const char** parent, int* distance) {
     if (p->cur_result >= p->num_results) return -1; /* no more results */
 
     /* give the caller whatever values they ask for */
@@ -249,25 +346,15 @@ int mii_search_result_write(mii_search_result* p, FILE* f, int mode, int flags)
 
 void mii_search_result_sort(mii_search_result* res) {
     /* order results based on multiple factors */
-    /* a simple selection sort will do fine */
+    /* heapsort in place: build a heap with the worst on top, then move it to the back */
 
-    int min_index;
-
-    /* no results to sort */
-    if (!res->num_results) return;
-
-    for (int i = 0; i < res->num_results - 1; ++i) {
-        min_index = i;
-
-        for (int j = i + 1; j < res->num_results; ++j) {
-            if (_mii_search_result_compare(res, j, min_index) < 0) {
-                min_index = j;
-            }
-        }
+    for (int i = res->num_results / 2 - 1; i >= 0; --i) {
+        _mii_search_result_sift_down(res, i, res->num_results);
+    }
 
-        if (min_index != i) {
-            _mii_search_result_swap(res, i, min_index);
-        }
+    for (int end = res->num_results - 1; end > 0; --end) {
+        _mii_search_result_swap(res, 0, end);
+        _mii_search_result_sift_down(res, 0, end);
     }
 }
 
@@ -284,7 +371,7 @@ void _mii_search_result_swap(mii_search_result* res, int a, int b) {
     res->priorities[a] = res->priorities[b];
     res->priorities[b] = tmp_num;
 
-    char* tmp;
+    const char* tmp;
 
     /* swap bins */
     tmp = res->bins[a];
@@ -296,6 +383,11 @@ void _mii_search_result_swap(mii_search_result* res, int a, int b) {
     res->codes[a] = res->codes[b];
     res->codes[b] = tmp;
 
+    /* swap sort keys */
+    tmp = res->keys[a];
+    res->keys[a] = res->keys[b];
+    res->keys[b] = tmp;
+
     /* swap parents */
     tmp = res->parents[a];
     res->parents[a] = res->parents[b];
@@ -303,7 +395,7 @@ void _mii_search_result_swap(mii_search_result* res, int a, int b) {
 }
 
 /* compare different search results in the following order: */
-/* binary -> priority -> parent -> code */
+/* binary -> priority -> parent -> code -> bin */
 int _mii_search_result_compare(mii_search_result* res, int a, int b) {
     int diff;
 
@@ -322,108 +414,20 @@ int _mii_search_result_compare(mii_search_result* res, int a, int b) {
     if (diff < 0) return 1;
     if (diff > 0) return -1;
 
-    /* finally, compare code alpha + version */
-    return _mii_search_result_compare_codes(res->codes[a], res->codes[b]);
-}
-
-/* compare module names alphabetically and versions numerically */
-int _mii_search_result_compare_codes(const char* code1, const char* code2) {
-    char* code1_cpy = mii_strdup(code1);
-    char* code2_cpy = mii_strdup(code2);
-
-    char* p1, *p2;
-    int diff;
-
-    int is_versioned = (strchr(code1_cpy, '/') != NULL) && (strchr(code2_cpy, '/') != NULL);
-
-    /* if versioned, split accordingly */
-    if (is_versioned) {
-        /* fine since pointer stays at beginning */
-        code1_cpy = strtok_r(code1_cpy, "/", &p1);
-        code2_cpy = strtok_r(code2_cpy, "/", &p2);
-    }
-
-    diff = strcmp(code1_cpy, code2_cpy);
-
-    /* order found or only compare alphas, cleanup before returning */
-    if (diff != 0 || !is_versioned) {
-        free(code1_cpy);
-        free(code2_cpy);
-    }
-
+    /* compare code alpha + version, the keys are built for this */
+    diff = strcmp(res->keys[a], res->keys[b]);
     if (diff > 0) return 1;
     if (diff < 0) return -1;
 
-    if (!is_versioned) return 0;
-
-    /* compare versions numerically */
-    char* token1 = strtok_r(NULL, ".", &p1);
-    char* token2 = strtok_r(NULL, ".", &p2);
-
-    while(diff == 0 && token1 != NULL && token2 != NULL) {
-        char* endptr1, *endptr2;
-
-        diff = strtol(token1, &endptr1, 10) - strtol(token2, &endptr2, 10);
-
-        /* one of the tokens is not a number */
-        if (token1 == endptr1 || token2 == endptr2) {
-            /* flipped to fit with the strtol return */
-            diff = - strcmp(token1, token2);
-        }
-
-        token1 = strtok_r(NULL, ".", &p1);
-        token2 = strtok_r(NULL, ".", &p2);
-    }
-
-    free(code1_cpy);
-    free(code2_cpy);
-
-    if (diff < 0) return 1;
-    if (diff > 0) return -1;
+    /* finally, keep ties in a stable order so limited searches agree with full ones */
+    diff = strcmp(res->bins[a], res->bins[b]);
+    if (diff > 0) return 1;
+    if (diff < 0) return -1;
 
     return 0;
 }
 
-int _mii_search_result_get_priority(const char* parents, const char* code) {
-    int priority = 0;
-    char* loaded_modules = getenv("LOADEDMODULES");
-
-    /* no modules loaded, no need to check */
-    if (loaded_modules == NULL) {
-        if (parents == NULL) return MII_SEARCH_RESULT_PRIORITY_NO_PARENT;
-        return 0;
-    }
-
-    /* iterate over every loaded module */
-    loaded_modules = mii_strdup(loaded_modules);
-    char* module_name = strtok(loaded_modules, ":");
-
-    while(module_name != NULL) {
-        /* check if module providing the cmd is already loaded */
-        if (strcmp(code, module_name) == 0) {
-            priority = MII_SEARCH_RESULT_PRIORITY_LOADED_MOD;
-            break;
-        }
-
-        /* check if parent is already loaded */
-        if (parents != NULL && strstr(parents, module_name) != NULL) {
-            priority += MII_SEARCH_RESULT_PRIORITY_LOADED_PARENT;
-        }
-
-        module_name = strtok(NULL, ":");
-    }
-    free(loaded_modules);
-
-    /* if no parents, but module is not loaded */
-    if (parents == NULL && priority != MII_SEARCH_RESULT_PRIORITY_LOADED_MOD) {
-        priority = MII_SEARCH_RESULT_PRIORITY_NO_PARENT;
-    }
-
-    return priority;
-}
-
-
-int mii_search_result_get_unique_bins(mii_search_result* res, char*** bins_out, int* num_results) {
+int mii_search_result_get_unique_bins(mii_search_result* res, const char*** bins_out, int* num_results) {
     /* get first <*num_results> unique bins */
 
     int unique_count = 0;
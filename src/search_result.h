@@ -29,29 +29,46 @@
 
 #define MII_SEARCH_RESULT_FUZZY_MAX 16
 
+/*
+ * limit modes, a limited result only keeps the best results as they are added
+ */
+
+#define MII_SEARCH_RESULT_LIMIT_RESULTS 0
+#define MII_SEARCH_RESULT_LIMIT_BINS    1 /* keep the best result of each bin */
+
+/*
+ * results reference the strings they are given, usually in a mapped index,
+ * which must outlive the result. only the query and <strings> are owned
+ */
+
 typedef struct _mii_search_result {
-    int num_results, cur_result;
-    char** codes, **bins, **parents, *query;
+    int num_results, cur_result, capacity;
+    int num_matches; /* every result added, including those dropped by the limit */
+    int limit, limit_mode;
+    const char** codes, **keys, **bins, **parents; /* keys come from mii_sort_key() */
+    char* query;
+    char* strings; /* storage of results read from `mii serve`, NULL otherwise */
     int* distances, *priorities;
 } mii_search_result;
 
 /* structure init + cleanup */
 
 int mii_search_result_init(mii_search_result* dest, const char* query);
+int mii_search_result_init_limited(mii_search_result* dest, const char* query, int limit, int mode); /* limit <= 0 keeps everything */
 void mii_search_result_free(mii_search_result* dest);
 
 /* adding results */
 
-void mii_search_result_add(mii_search_result* p, const char* code, const char* bin, int distance, const char* parent);
+void mii_search_result_add(mii_search_result* p, const char* code, const char* key, const char* bin, int distance, const char* parent, int priority);
 
 /* sorting/filtering results */
 
 void mii_search_result_sort(mii_search_result* p);
-int mii_search_result_get_unique_bins(mii_search_result* res, char*** bins_out, int* num_results);
+int mii_search_result_get_unique_bins(mii_search_result* res, const char*** bins_out, int* num_results);
 
 /* reading/outputting results */
 
-int mii_search_result_next(mii_search_result* p, char** code, char** bin, char** parent, int* distance);
+int mii_search_result_next(mii_search_result* p, const char** code, const char** bin, const char** parent, int* distance);
 int mii_search_result_write(mii_search_result* p, FILE* f, int type, int flags);
 
 #endif
@@ -0,0 +1,444 @@
+#define _POSIX_C_SOURCE 200809L
+
+/* the peer credential calls are extensions everywhere */
+#define _GNU_SOURCE
+#define _DARWIN_C_SOURCE
+
+#include "serve.h"
+#include "util.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* growable message being written */
+typedef struct _mii_serve_buffer {
+    char* data;
+    size_t size, capacity;
+} mii_serve_buffer;
+
+int _mii_serve_address(const char* path, struct sockaddr_un* addr);
+int _mii_serve_connect(const char* path);
+int _mii_serve_trusted(const char* path);
+int _mii_serve_peer_trusted(int fd);
+void _mii_serve_timeout(int fd);
+
+/* message helpers */
+void _mii_serve_put(mii_serve_buffer* buf, const char* field);
+void _mii_serve_put_int(mii_serve_buffer* buf, int value);
+int _mii_serve_send(int fd, mii_serve_buffer* buf);
+char* _mii_serve_recv(int fd, size_t max, size_t* size);
+char* _mii_serve_field(char** cur, char* end);
+int _mii_serve_field_int(char** cur, char* end, int* out);
+
+char* mii_serve_default_socket(const char* datadir) {
+    char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+
+    if (runtime_dir && *runtime_dir) return mii_join_path(runtime_dir, MII_SERVE_SOCKET_NAME);
+
+    /* never a shared directory, another user could bind the name first */
+    return mii_join_path(datadir, MII_SERVE_SOCKET_NAME);
+}
+
+void mii_serve_index_id(const struct stat* st, char* out) {
+    snprintf(out, MII_SERVE_INDEX_ID_SIZE, "%ju:%ju", (uintmax_t) st->st_dev, (uintmax_t) st->st_ino);
+}
+
+/*
+ * bind a socket only the current user can connect to
+ * a socket left behind by a daemon which died is replaced
+ */
+int mii_serve_listen(const char* path) {
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (_mii_serve_address(path, &addr)) {
+        mii_error("Socket path %s is too long!", path);
+        return -1;
+    }
+
+    int probe = _mii_serve_connect(path);
+
+    if (probe >= 0) {
+        close(probe);
+        mii_error("Another daemon is already listening on %s!", path);
+        return -1;
+    }
+
+    if (!lstat(path, &st)) {
+        if (!S_ISSOCK(st.st_mode)) {
+            mii_error("Refusing to replace %s, it is not a socket!", path);
+            return -1;
+        }
+
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        mii_error("Couldn't create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    mode_t mask = umask(0177);
+    int res = bind(fd, (struct sockaddr*) &addr, sizeof addr);
+    umask(mask);
+
+    if (res || listen(fd, 16)) {
+        mii_error("Couldn't listen on %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * read a whole request from a client
+ */
+int mii_serve_read_request(int fd, mii_serve_request* req) {
+    size_t size;
+
+    memset(req, 0, sizeof *req);
+    _mii_serve_timeout(fd);
+
+    if (!(req->buf = _mii_serve_recv(fd, MII_SERVE_MAX_REQUEST, &size))) return -1;
+
+    char* cur = req->buf, *end = req->buf + size;
+    const char* protocol = _mii_serve_field(&cur, end);
+
+    if (!protocol || strcmp(protocol, MII_SERVE_PROTOCOL)) {
+        mii_serve_request_free(req);
+        return -1;
+    }
+
+    if (!(req->index = _mii_serve_field(&cur, end)) ||
+        !(req->op = _mii_serve_field(&cur, end)) ||
+        !(req->query = _mii_serve_field(&cur, end)) ||
+        _mii_serve_field_int(&cur, end, &req->limit) ||
+        _mii_serve_field_int(&cur, end, &req->limit_mode) ||
+        !(req->loaded_modules = _mii_serve_field(&cur, end))) {
+        mii_serve_request_free(req);
+        return -1;
+    }
+
+    return 0;
+}
+
+void mii_serve_request_free(mii_serve_request* req) {
+    free(req->buf);
+    req->buf = NULL;
+}
+
+/*
+ * send sorted results, the client keeps their order
+ */
+int mii_serve_write_result(int fd, mii_search_result* res) {
+    mii_serve_buffer buf = {0};
+
+    _mii_serve_put(&buf, "ok");
+    _mii_serve_put_int(&buf, res->num_matches);
+    _mii_serve_put_int(&buf, res->num_results);
+
+    for (int i = 0; i < res->num_results; ++i) {
+        _mii_serve_put(&buf, res->codes[i]);
+        _mii_serve_put(&buf, res->keys[i]);
+        _mii_serve_put(&buf, res->bins[i]);
+        _mii_serve_put(&buf, res->parents[i]);
+        _mii_serve_put_int(&buf, res->distances[i]);
+        _mii_serve_put_int(&buf, res->priorities[i]);
+    }
+
+    return _mii_serve_send(fd, &buf);
+}
+
+int mii_serve_write_error(int fd, const char* message) {
+    mii_serve_buffer buf = {0};
+
+    _mii_serve_put(&buf, "error");
+    _mii_serve_put(&buf, message);
+
+    return _mii_serve_send(fd, &buf);
+}
+
+int mii_serve_query(const char* path, const char* index, const char* op, const char* query, int limit, int limit_mode, const char* loaded_modules, mii_search_result* res) {
+    /* the shell hook loads whatever the reply names, so only a daemon of this user is asked */
+    if (_mii_serve_trusted(path)) return -1;
+
+    int fd = _mii_serve_connect(path);
+    if (fd < 0) return -1;
+
+    if (_mii_serve_peer_trusted(fd)) {
+        close(fd);
+        return -1;
+    }
+
+    mii_serve_buffer buf = {0};
+
+    _mii_serve_put(&buf, MII_SERVE_PROTOCOL);
+    _mii_serve_put(&buf, index);
+    _mii_serve_put(&buf, op);
+    _mii_serve_put(&buf, query);
+    _mii_serve_put_int(&buf, limit);
+    _mii_serve_put_int(&buf, limit_mode);
+    _mii_serve_put(&buf, loaded_modules ? loaded_modules : "");
+
+    /* the daemon answers once it sees the end of the request */
+    size_t size;
+    char* answer = NULL;
+
+    if (!_mii_serve_send(fd, &buf) && !shutdown(fd, SHUT_WR)) {
+        answer = _mii_serve_recv(fd, SIZE_MAX, &size);
+    }
+
+    close(fd);
+
+    if (!answer) return -1;
+
+    char* cur = answer, *end = answer + size;
+    const char* status = _mii_serve_field(&cur, end);
+    int num_matches, num_results;
+
+    /* an error reply carries the reason, e.g. the daemon serves another index */
+    if (!status || strcmp(status, "ok")) {
+        mii_debug("Daemon didn't answer the query: %s", status ? cur : "malformed reply");
+        free(answer);
+        return -1;
+    }
+
+    if (_mii_serve_field_int(&cur, end, &num_matches) || _mii_serve_field_int(&cur, end, &num_results)) {
+        free(answer);
+        return -1;
+    }
+
+    /* the result strings stay in the answer, which the result now owns */
+    mii_search_result_init(res, query);
+    res->strings = answer;
+
+    for (int i = 0; i < num_results; ++i) {
+        const char* code, *key, *bin, *parent;
+        int distance, priority;
+
+        if (!(code = _mii_serve_field(&cur, end)) ||
+            !(key = _mii_serve_field(&cur, end)) ||
+            !(bin = _mii_serve_field(&cur, end)) ||
+            !(parent = _mii_serve_field(&cur, end)) ||
+            _mii_serve_field_int(&cur, end, &distance) ||
+            _mii_serve_field_int(&cur, end, &priority)) {
+            mii_search_result_free(res);
+            return -1;
+        }
+
+        mii_search_result_add(res, code, key, bin, distance, parent, priority);
+    }
+
+    res->num_matches = num_matches;
+
+    return 0;
+}
+
+int _mii_serve_address(const char* path, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof addr->sun_path) return -1;
+
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int _mii_serve_connect(const char* path) {
+    struct sockaddr_un addr;
+
+    if (_mii_serve_address(path, &addr)) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    if (connect(fd, (struct sockaddr*) &addr, sizeof addr)) {
+        close(fd);
+        return -1;
+    }
+
+    _mii_serve_timeout(fd);
+    return fd;
+}
+
+/*
+ * check that a socket and its directory belong to this user and nobody else can replace or use them
+ */
+int _mii_serve_trusted(const char* path) {
+    struct stat st;
+    uid_t uid = getuid();
+
+    if (lstat(path, &st)) return -1;
+
+    if (!S_ISSOCK(st.st_mode) || st.st_uid != uid || (st.st_mode & (S_IRWXG | S_IRWXO))) {
+        mii_warn("Not trusting socket %s, it isn't a private socket of this user", path);
+        return -1;
+    }
+
+    char* dir = mii_strdup(path);
+    char* slash = strrchr(dir, '/');
+
+    if (!slash) strcpy(dir, ".");
+    else if (slash == dir) slash[1] = 0;
+    else *slash = 0;
+
+    int res = stat(dir, &st);
+
+    if (res || st.st_uid != uid || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        mii_warn("Not trusting socket %s, other users can write to %s", path, dir);
+        res = -1;
+    }
+
+    free(dir);
+    return res;
+}
+
+/*
+ * check that the daemon on the other end runs as this user
+ */
+int _mii_serve_peer_trusted(int fd) {
+    uid_t uid;
+
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof cred;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) return -1;
+    uid = cred.uid;
+#else
+    gid_t gid;
+
+    if (getpeereid(fd, &uid, &gid)) return -1;
+#endif
+
+    if (uid != getuid()) {
+        mii_warn("Not trusting the daemon on the socket, it runs as user %ld", (long) uid);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * neither side should hang on a peer which stopped responding
+ */
+void _mii_serve_timeout(int fd) {
+    struct timeval tv = { MII_SERVE_TIMEOUT, 0 };
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+}
+
+void _mii_serve_put(mii_serve_buffer* buf, const char* field) {
+    size_t len = strlen(field) + 1;
+
+    if (buf->size + len > buf->capacity) {
+        while (buf->size + len > buf->capacity) buf->capacity = buf->capacity ? buf->capacity * 2 : 4096;
+        buf->data = realloc(buf->data, buf->capacity);
+    }
+
+    memcpy(buf->data + buf->size, field, len);
+    buf->size += len;
+}
+
+void _mii_serve_put_int(mii_serve_buffer* buf, int value) {
+    char field[16];
+    snprintf(field, sizeof field, "%d", value);
+    _mii_serve_put(buf, field);
+}
+
+/*
+ * write and release a message
+ */
+int _mii_serve_send(int fd, mii_serve_buffer* buf) {
+    size_t done = 0;
+
+    while (done < buf->size) {
+        /* a peer which went away must not kill this process with SIGPIPE */
+        ssize_t res = send(fd, buf->data + done, buf->size - done, MSG_NOSIGNAL);
+
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        done += res;
+    }
+
+    free(buf->data);
+    return (done == buf->size) ? 0 : -1;
+}
+
+/*
+ * read until the peer shuts down its side, at most <max> bytes
+ */
+char* _mii_serve_recv(int fd, size_t max, size_t* size) {
+    size_t capacity = 4096;
+    char* data = malloc(capacity);
+
+    *size = 0;
+
+    while (1) {
+        if (*size == capacity) {
+            if (capacity >= max) {
+                free(data);
+                return NULL;
+            }
+
+            capacity *= 2;
+            data = realloc(data, capacity);
+        }
+
+        ssize_t res = read(fd, data + *size, capacity - *size);
+
+        if (res < 0) {
+            if (errno == EINTR) continue;
+
+            free(data);
+            return NULL;
+        }
+
+        if (!res) {
+            /* terminate the last field even if the peer didn't */
+            data = realloc(data, *size + 1);
+            data[*size] = 0;
+            return data;
+        }
+
+        *size += res;
+    }
+}
+
+/*
+ * take the next field of a message, NULL if it is truncated
+ */
+char* _mii_serve_field(char** cur, char* end) {
+    char* field = *cur, *nul = memchr(field, 0, end - field);
+
+    if (!nul) return NULL;
+
+    *cur = nul + 1;
+    return field;
+}
+
+int _mii_serve_field_int(char** cur, char* end, int* out) {
+    char* field = _mii_serve_field(cur, end), *rest;
+
+    if (!field || !*field) return -1;
+
+    *out = strtol(field, &rest, 10);
+    return *rest ? -1 : 0;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+/*
+ * mii_serve
+ *
+ * query protocol between `mii serve` and clients over a unix socket
+ * a client writes one request, shuts down its side and reads the answer,
+ * every field of either message is a NUL-terminated string
+ */
+
+#include <stddef.h>
+
+#include <sys/stat.h>
+
+#include "search_result.h"
+
+/* bumped whenever a message changes, both sides must agree */
+#define MII_SERVE_PROTOCOL "mii-serve-1"
+
+/* socket name used when none is given */
+#define MII_SERVE_SOCKET_NAME "mii.sock"
+
+/* largest request the daemon accepts, LOADEDMODULES can get long */
+#define MII_SERVE_MAX_REQUEST (1 << 20)
+
+/* seconds either side waits on the other before giving up */
+#define MII_SERVE_TIMEOUT 2
+
+/* room for an index identity, see mii_serve_index_id() */
+#define MII_SERVE_INDEX_ID_SIZE 48
+
+/* search operations a daemon answers */
+#define MII_SERVE_OP_EXACT  "exact"
+#define MII_SERVE_OP_SEARCH "search"
+#define MII_SERVE_OP_SHOW   "show"
+
+typedef struct _mii_serve_request {
+    char* buf; /* every field points into this */
+    const char* index, *op, *query, *loaded_modules; /* index is the id of the client's index file */
+    int limit, limit_mode;
+} mii_serve_request;
+
+/* default socket path, in $XDG_RUNTIME_DIR when set so it stays on the local node, the data directory otherwise */
+char* mii_serve_default_socket(const char* datadir);
+
+/* identify an index file by device and inode, which every rewrite replaces */
+void mii_serve_index_id(const struct stat* st, char* out);
+
+/* daemon side */
+int mii_serve_listen(const char* path);
+int mii_serve_read_request(int fd, mii_serve_request* req);
+void mii_serve_request_free(mii_serve_request* req);
+int mii_serve_write_result(int fd, mii_search_result* res);
+int mii_serve_write_error(int fd, const char* message);
+
+/*
+ * client side, ask the daemon at <path> to search <index>
+ * returns -1 quietly when no daemon answers so the caller can search locally
+ */
+int mii_serve_query(const char* path, const char* index, const char* op, const char* query, int limit, int limit_mode, const char* loaded_modules, mii_search_result* res);
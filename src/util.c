@@ -1,4 +1,5 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE /* dirent d_type */
 
 #include "util.h"
 
@@ -7,13 +8,30 @@
 #include <string.h>
 
 #include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <errno.h>
 #include <libgen.h>
 
+/* x86-64 always has SSE2, wider kernels are selected at runtime */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define MII_DISTANCE_X86
+#include <immintrin.h>
+#endif
+
+void _mii_levenshtein_batch_scalar(const uint64_t* peq, int m, const char* const* strs, int count, int* out);
+
+#ifdef MII_DISTANCE_X86
+void _mii_levenshtein_batch_sse2(const uint64_t* peq, int m, const char* const* strs, int count, int* out);
+__attribute__((target("avx2")))
+void _mii_levenshtein_batch_avx2(const uint64_t* peq, int m, const char* const* strs, int count, int* out);
+#endif
+
 char* mii_strdup(const char* str) {
     int len = strlen(str);
     char* out = malloc(len + 1);
@@ -38,6 +56,69 @@ char* mii_join_path(const char* a, const char* b) {
     return out;
 }
 
+char* mii_fold_case(const char* str) {
+    char* out = mii_strdup(str);
+
+    for (char* c = out; *c; ++c) *c = tolower((unsigned char) *c);
+
+    return out;
+}
+
+char* mii_sort_key(const char* code) {
+    /*
+     * encode a module code so a plain byte comparison ranks it:
+     * the name as-is, then each dot-separated version part. numeric parts
+     * are stored as their digit count and digits, both inverted so larger
+     * numbers come first, other parts as text. low control bytes mark
+     * the parts and a high byte ends the key, so longer versions come first
+     */
+
+    const char* version = strchr(code, '/');
+
+    if (!version) return mii_strdup(code);
+
+    char* out = malloc(2 * strlen(code) + 4), *o = out;
+
+    memcpy(o, code, version - code);
+    o += version - code;
+    *o++ = 0x01;
+
+    for (const char* c = version + 1; *c;) {
+        /* empty parts are skipped */
+        if (*c == '.') {
+            ++c;
+            continue;
+        }
+
+        if (isdigit((unsigned char) *c)) {
+            /* drop leading zeros, keeping at least one digit */
+            while (*c == '0' && isdigit((unsigned char) c[1])) ++c;
+
+            int digits = 0;
+            while (isdigit((unsigned char) c[digits])) ++digits;
+
+            *o++ = 0x02;
+            *o++ = (char) (0xFF - mii_min(digits, 0xFD));
+
+            for (int i = 0; i < digits; ++i) *o++ = '0' + '9' - c[i];
+
+            c += digits;
+        } else {
+            *o++ = 0x03;
+        }
+
+        /* anything after the digits is compared as text */
+        while (*c && *c != '.') *o++ = *c++;
+
+        *o++ = 0x01;
+    }
+
+    *o++ = (char) 0xFE;
+    *o = 0;
+
+    return out;
+}
+
 int mii_levenshtein_distance(const char* a, const char* b) {
     /*
      * quickly compute the damerau-levenshtein distance between
@@ -80,6 +161,402 @@ int mii_levenshtein_distance(const char* a, const char* b) {
     return result;
 }
 
+int mii_damerau_distance(const char* a, const char* b) {
+    /*
+     * compute the unrestricted damerau-levenshtein distance between
+     * string <a> and <b>. unlike mii_levenshtein_distance() this allows
+     * edits between transposed characters, which makes it a true metric
+     */
+
+    int a_len = strlen(a), b_len = strlen(b);
+    int width = b_len + 2, max_dist = a_len + b_len;
+
+    /* last row each (case-folded) character was seen in <a> */
+    int last_row[UCHAR_MAX + 1] = {0};
+
+    int* mat = malloc((a_len + 2) * width * sizeof *mat);
+
+    /* the extra border row/column holds the maximum distance */
+    mat[0] = max_dist;
+
+    for (int i = 0; i <= a_len; ++i) {
+        mat[(i + 1) * width] = max_dist;
+        mat[(i + 1) * width + 1] = i;
+    }
+
+    for (int j = 0; j <= b_len; ++j) {
+        mat[j + 1] = max_dist;
+        mat[width + j + 1] = j;
+    }
+
+    for (int i = 1; i <= a_len; ++i) {
+        int last_col = 0;
+        int ca = tolower((unsigned char) a[i - 1]);
+
+        for (int j = 1; j <= b_len; ++j) {
+            int cb = tolower((unsigned char) b[j - 1]);
+            int i1 = last_row[cb], j1 = last_col;
+            int cost = 1;
+
+            if (ca == cb) {
+                cost = 0;
+                last_col = j;
+            }
+
+            int deletion  = mat[i * width + j + 1] + 1;
+            int insertion = mat[(i + 1) * width + j] + 1;
+            int substitution = mat[i * width + j] + cost;
+            int transposition = mat[i1 * width + j1] + (i - i1 - 1) + 1 + (j - j1 - 1);
+
+            mat[(i + 1) * width + j + 1] = mii_min(mii_min(deletion, insertion), mii_min(substitution, transposition));
+        }
+
+        last_row[ca] = i;
+    }
+
+    int result = mat[(a_len + 1) * width + b_len + 1];
+
+    free(mat);
+
+    return result;
+}
+
+int mii_levenshtein_distance_bounded(const char* a, const char* b, int bound) {
+    /*
+     * restricted damerau-levenshtein distance, as mii_levenshtein_distance(),
+     * but only the diagonal band a result within <bound> can pass through is
+     * computed. the band lives in three rolling rows on the stack: cell (i, j)
+     * is stored at column j - i + bound + 1, with a sentinel at either end
+     */
+
+    if (bound > MII_DISTANCE_MAX_BOUND) bound = MII_DISTANCE_MAX_BOUND;
+
+    int a_len = strlen(a), b_len = strlen(b);
+    int over = bound + 1, width = 2 * bound + 1;
+
+    if (a_len - b_len > bound || b_len - a_len > bound) return over;
+
+    int rows[3][2 * MII_DISTANCE_MAX_BOUND + 3];
+    int* prev2 = rows[0], *prev = rows[1], *cur = rows[2];
+
+    for (int c = 0; c < width + 2; ++c) prev2[c] = prev[c] = cur[c] = over;
+
+    /* first row: distance from the empty prefix */
+    for (int j = 0; j <= b_len && j <= bound; ++j) cur[j + bound + 1] = j;
+
+    int prev_min = 0;
+
+    for (int i = 1; i <= a_len; ++i) {
+        int* tmp = prev2;
+        prev2 = prev;
+        prev = cur;
+        cur = tmp;
+
+        for (int c = 0; c < width + 2; ++c) cur[c] = over;
+
+        int row_min = over;
+
+        if (i <= bound) cur[bound - i + 1] = row_min = i;
+
+        int j_lo = (i - bound > 1) ? i - bound : 1;
+        int j_hi = (i + bound < b_len) ? i + bound : b_len;
+
+        for (int j = j_lo; j <= j_hi; ++j) {
+            int c = j - i + bound + 1;
+
+            int substitution = prev[c] + (a[i - 1] != b[j - 1]);
+            int deletion  = prev[c + 1] + 1;
+            int insertion = cur[c - 1] + 1;
+
+            int val = mii_min(substitution, mii_min(deletion, insertion));
+
+            /* transposition, the diagonal two rows up shares the column */
+            if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1]) {
+                val = mii_min(val, prev2[c] + 1);
+            }
+
+            cur[c] = mii_min(val, over);
+            row_min = mii_min(row_min, cur[c]);
+        }
+
+        /* every path to the corner crosses one of the last two rows */
+        if (row_min > bound && prev_min > bound) return over;
+
+        prev_min = row_min;
+    }
+
+    return mii_min(cur[b_len - a_len + bound + 1], over);
+}
+
+int mii_damerau_distance_bounded(const char* a, const char* b, int bound) {
+    /*
+     * unrestricted damerau-levenshtein distance, as mii_damerau_distance(),
+     * banded like mii_levenshtein_distance_bounded(). a transposition can
+     * reach back at most <bound> + 1 rows before costing more than <bound>,
+     * so that many rows are kept in a ring on the stack
+     */
+
+    if (bound > MII_DISTANCE_MAX_BOUND) bound = MII_DISTANCE_MAX_BOUND;
+
+    int a_len = strlen(a), b_len = strlen(b);
+    int over = bound + 1, width = 2 * bound + 1, ring = bound + 2;
+
+    if (a_len - b_len > bound || b_len - a_len > bound) return over;
+
+    int rows[MII_DISTANCE_MAX_BOUND + 2][2 * MII_DISTANCE_MAX_BOUND + 3];
+
+    /* last row each character was seen in <a>, 0 if not yet seen */
+    int last_row[UCHAR_MAX + 1] = {0};
+
+    for (int c = 0; c < width + 2; ++c) rows[0][c] = over;
+    for (int j = 0; j <= b_len && j <= bound; ++j) rows[0][j + bound + 1] = j;
+
+    for (int i = 1; i <= a_len; ++i) {
+        int* cur = rows[i % ring], *prev = rows[(i - 1) % ring];
+        unsigned char ca = a[i - 1];
+
+        for (int c = 0; c < width + 2; ++c) cur[c] = over;
+
+        int row_min = over;
+
+        if (i <= bound) cur[bound - i + 1] = row_min = i;
+
+        int j_lo = (i - bound > 1) ? i - bound : 1;
+        int j_hi = (i + bound < b_len) ? i + bound : b_len;
+
+        /* last column in this row matching ca, including columns left of the band */
+        int last_col = 0;
+
+        for (int j = 1; j < j_lo; ++j) {
+            if ((unsigned char) b[j - 1] == ca) last_col = j;
+        }
+
+        for (int j = j_lo; j <= j_hi; ++j) {
+            unsigned char cb = b[j - 1];
+            int c = j - i + bound + 1;
+
+            int substitution = prev[c] + (ca != cb);
+            int deletion  = prev[c + 1] + 1;
+            int insertion = cur[c - 1] + 1;
+
+            int val = mii_min(substitution, mii_min(deletion, insertion));
+
+            /* transposition from the cell before the last matching pair */
+            int i1 = last_row[cb], j1 = last_col;
+
+            if (i1 && j1 && i - i1 <= bound) {
+                int c1 = j1 - i1 + bound + 1;
+
+                if (c1 >= 1 && c1 <= width) {
+                    val = mii_min(val, rows[(i1 - 1) % ring][c1] + (i - i1 - 1) + 1 + (j - j1 - 1));
+                }
+            }
+
+            if (ca == cb) last_col = j;
+
+            cur[c] = mii_min(val, over);
+            row_min = mii_min(row_min, cur[c]);
+        }
+
+        last_row[ca] = i;
+
+        /* row minimums never decrease, so the corner can't come back under the bound */
+        if (row_min > bound) return over;
+    }
+
+    return mii_min(rows[a_len % ring][b_len - a_len + bound + 1], over);
+}
+
+void mii_levenshtein_distance_batch(const char* query, const char* const* strs, int count, int* out) {
+    /*
+     * hyyro's bit-parallel variant of myers' algorithm: one column of the
+     * distance matrix is kept as vertical +1/-1 deltas in a word, so every
+     * character of a candidate costs a handful of word operations.
+     * the SIMD kernels run one candidate per 64-bit lane
+     */
+
+    int m = strlen(query);
+
+    if (!m || m > MII_DISTANCE_BATCH_MAX_QUERY) {
+        for (int s = 0; s < count; ++s) {
+            out[s] = m ? mii_levenshtein_distance(query, strs[s]) : (int) strlen(strs[s]);
+        }
+
+        return;
+    }
+
+    /* bit i of peq[c] is set where query[i] == c */
+    uint64_t peq[256] = {0};
+
+    for (int i = 0; i < m; ++i) peq[(unsigned char) query[i]] |= 1ULL << i;
+
+#ifdef MII_DISTANCE_X86
+    if (__builtin_cpu_supports("avx2")) {
+        _mii_levenshtein_batch_avx2(peq, m, strs, count, out);
+    } else {
+        _mii_levenshtein_batch_sse2(peq, m, strs, count, out);
+    }
+#else
+    _mii_levenshtein_batch_scalar(peq, m, strs, count, out);
+#endif
+}
+
+void _mii_levenshtein_batch_scalar(const uint64_t* peq, int m, const char* const* strs, int count, int* out) {
+    uint64_t last = 1ULL << (m - 1);
+
+    for (int s = 0; s < count; ++s) {
+        uint64_t pv = ~0ULL, mv = 0, d0 = 0, eq = 0;
+        int score = m;
+
+        for (const unsigned char* c = (const unsigned char*) strs[s]; *c; ++c) {
+            uint64_t prev_eq = eq;
+            eq = peq[*c];
+
+            /* a transposition ends where the previous column missed but the swapped pair matches */
+            uint64_t tr = ((~d0 & eq) << 1) & prev_eq;
+
+            d0 = (((eq & pv) + pv) ^ pv) | eq | mv | tr;
+
+            uint64_t ph = mv | ~(d0 | pv);
+            uint64_t mh = pv & d0;
+
+            /* the last row tracks the distance to the whole query */
+            score += ((ph & last) != 0) - ((mh & last) != 0);
+
+            ph = (ph << 1) | 1;
+            mh <<= 1;
+
+            pv = mh | ~(d0 | ph);
+            mv = ph & d0;
+        }
+
+        out[s] = score;
+    }
+}
+
+#ifdef MII_DISTANCE_X86
+void _mii_levenshtein_batch_sse2(const uint64_t* peq, int m, const char* const* strs, int count, int* out) {
+    const __m128i ones = _mm_set1_epi64x(-1), one = _mm_set1_epi64x(1);
+    const __m128i last = _mm_cvtsi32_si128(m - 1);
+
+    int s = 0;
+
+    for (; s + 2 <= count; s += 2) {
+        const unsigned char* c0 = (const unsigned char*) strs[s];
+        const unsigned char* c1 = (const unsigned char*) strs[s + 1];
+
+        __m128i pv = ones, mv = _mm_setzero_si128(), d0 = mv, eq = mv;
+        __m128i score = _mm_set1_epi64x(m);
+
+        /* a finished lane keeps stepping on NUL but its score no longer moves */
+        while (*c0 | *c1) {
+            __m128i active = _mm_set_epi64x(-(long long) (*c1 != 0), -(long long) (*c0 != 0));
+            __m128i prev_eq = eq;
+
+            eq = _mm_set_epi64x((long long) peq[*c1], (long long) peq[*c0]);
+
+            __m128i tr = _mm_and_si128(_mm_slli_epi64(_mm_andnot_si128(d0, eq), 1), prev_eq);
+            __m128i sum = _mm_add_epi64(_mm_and_si128(eq, pv), pv);
+
+            d0 = _mm_or_si128(_mm_or_si128(_mm_xor_si128(sum, pv), eq), _mm_or_si128(mv, tr));
+
+            __m128i ph = _mm_or_si128(mv, _mm_andnot_si128(_mm_or_si128(d0, pv), ones));
+            __m128i mh = _mm_and_si128(pv, d0);
+
+            score = _mm_add_epi64(score, _mm_and_si128(active, _mm_and_si128(_mm_srl_epi64(ph, last), one)));
+            score = _mm_sub_epi64(score, _mm_and_si128(active, _mm_and_si128(_mm_srl_epi64(mh, last), one)));
+
+            ph = _mm_or_si128(_mm_slli_epi64(ph, 1), one);
+            mh = _mm_slli_epi64(mh, 1);
+
+            pv = _mm_or_si128(mh, _mm_andnot_si128(_mm_or_si128(d0, ph), ones));
+            mv = _mm_and_si128(ph, d0);
+
+            c0 += (*c0 != 0);
+            c1 += (*c1 != 0);
+        }
+
+        int64_t lanes[2];
+        _mm_storeu_si128((__m128i*) lanes, score);
+
+        out[s] = lanes[0];
+        out[s + 1] = lanes[1];
+    }
+
+    _mii_levenshtein_batch_scalar(peq, m, strs + s, count - s, out + s);
+}
+
+__attribute__((target("avx2")))
+void _mii_levenshtein_batch_avx2(const uint64_t* peq, int m, const char* const* strs, int count, int* out) {
+    const __m256i ones = _mm256_set1_epi64x(-1), one = _mm256_set1_epi64x(1);
+    const __m128i last = _mm_cvtsi32_si128(m - 1);
+
+    int s = 0;
+
+    for (; s + 4 <= count; s += 4) {
+        const unsigned char* c[4];
+
+        for (int l = 0; l < 4; ++l) c[l] = (const unsigned char*) strs[s + l];
+
+        __m256i pv = ones, mv = _mm256_setzero_si256(), d0 = mv, eq = mv;
+        __m256i score = _mm256_set1_epi64x(m);
+
+        while (*c[0] | *c[1] | *c[2] | *c[3]) {
+            __m256i active = _mm256_set_epi64x(-(long long) (*c[3] != 0), -(long long) (*c[2] != 0),
+                                               -(long long) (*c[1] != 0), -(long long) (*c[0] != 0));
+            __m256i prev_eq = eq;
+
+            eq = _mm256_set_epi64x((long long) peq[*c[3]], (long long) peq[*c[2]],
+                                   (long long) peq[*c[1]], (long long) peq[*c[0]]);
+
+            __m256i tr = _mm256_and_si256(_mm256_slli_epi64(_mm256_andnot_si256(d0, eq), 1), prev_eq);
+            __m256i sum = _mm256_add_epi64(_mm256_and_si256(eq, pv), pv);
+
+            d0 = _mm256_or_si256(_mm256_or_si256(_mm256_xor_si256(sum, pv), eq), _mm256_or_si256(mv, tr));
+
+            __m256i ph = _mm256_or_si256(mv, _mm256_andnot_si256(_mm256_or_si256(d0, pv), ones));
+            __m256i mh = _mm256_and_si256(pv, d0);
+
+            score = _mm256_add_epi64(score, _mm256_and_si256(active, _mm256_and_si256(_mm256_srl_epi64(ph, last), one)));
+            score = _mm256_sub_epi64(score, _mm256_and_si256(active, _mm256_and_si256(_mm256_srl_epi64(mh, last), one)));
+
+            ph = _mm256_or_si256(_mm256_slli_epi64(ph, 1), one);
+            mh = _mm256_slli_epi64(mh, 1);
+
+            pv = _mm256_or_si256(mh, _mm256_andnot_si256(_mm256_or_si256(d0, ph), ones));
+            mv = _mm256_and_si256(ph, d0);
+
+            for (int l = 0; l < 4; ++l) c[l] += (*c[l] != 0);
+        }
+
+        int64_t lanes[4];
+        _mm256_storeu_si256((__m256i*) lanes, score);
+
+        for (int l = 0; l < 4; ++l) out[s + l] = lanes[l];
+    }
+
+    /* the remainder still gets two lanes at a time */
+    _mii_levenshtein_batch_sse2(peq, m, strs + s, count - s, out + s);
+}
+#endif
+
+/*
+ * the file type readdir() reported for an entry, 0 if the caller must stat it
+ * links are left to stat since their target decides how they are treated
+ */
+mode_t mii_dirent_mode(const struct dirent* dp) {
+#ifdef DT_UNKNOWN
+    switch (dp->d_type) {
+    case DT_DIR:
+        return S_IFDIR;
+    case DT_REG:
+        return S_IFREG;
+    }
+#endif
+
+    return 0;
+}
+
 int mii_recursive_mkdir(const char *path, mode_t mode) {
     int res;
     struct stat st;
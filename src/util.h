@@ -2,11 +2,38 @@
 
 #include <sys/types.h>
 
+struct dirent;
+
 /* generic utils */
 
 #define mii_min(x, y) ((x < y) ? (x) : (y))
 
+/* largest bound the bounded distance functions work with, larger bounds are clamped */
+#define MII_DISTANCE_MAX_BOUND 32
+
+/* longest query the bit-parallel batch kernel scores in one machine word */
+#define MII_DISTANCE_BATCH_MAX_QUERY 64
+
 char* mii_strdup(const char* str);
 char* mii_join_path(const char* a, const char* b);
+char* mii_fold_case(const char* str);
+char* mii_sort_key(const char* code); /* strcmp() orders keys as names, then versions newest first */
 int mii_levenshtein_distance(const char* a, const char* b);
+int mii_damerau_distance(const char* a, const char* b);
+
+/*
+ * bounded variants compare case-folded strings byte for byte and
+ * return <bound> + 1 as soon as the distance is known to exceed <bound>
+ */
+int mii_levenshtein_distance_bounded(const char* a, const char* b, int bound);
+int mii_damerau_distance_bounded(const char* a, const char* b, int bound);
+
+/*
+ * score the case-folded <query> against <count> case-folded strings, storing
+ * the restricted damerau-levenshtein distance of each in <out>
+ */
+void mii_levenshtein_distance_batch(const char* query, const char* const* strs, int count, int* out);
 int mii_recursive_mkdir(const char* path, mode_t mode);
+
+/* file type of a directory entry without a stat when the filesystem reports it, else 0 */
+mode_t mii_dirent_mode(const struct dirent* dp);